@@ -28,24 +28,449 @@
  * calculated).  Each time interval or "tick", the delta of the first node is
  * decremented.  When it reaches 0, a callback is executed and the node is
  * removed from the list.
+ *
+ * Alternatively (engine DELTA_ENGINE_WHEEL) the nodes are kept in a
+ * hierarchical timing wheel.  Level 0 has a slot for each of the next
+ * WHEEL_SIZE ticks, and each higher level has slots WHEEL_SIZE times as wide.
+ * A node goes in the lowest level whose range covers its expiry time.  Each
+ * time the lower levels wrap around, the next slot of the level above is
+ * emptied and its nodes are redistributed, so a node moves down at most
+ * WHEEL_LEVELS - 1 times before it expires.  Inserting or removing a node is
+ * O(1) whatever its time-to-live.
+ *
+ * The hash table doubles in size when it averages more than HT_MAX_LOAD
+ * elements per bucket, and halves when it falls below one element per
+ * HT_MIN_LOAD buckets.  Rather than rehashing every element at once, the old
+ * table is kept and its buckets are moved a few at a time by each subsequent
+ * insertion or removal.  An element lives in the old table until its bucket
+ * has been moved, so lookups check exactly one bucket either way.
+ *
+ * Lookups (delta_contains() and delta_get()) take no lock.  Writers publish
+ * nodes with release stores, and rehashing, the only operation that moves a
+ * node between chains, is bracketed by a sequence count that readers check.
+ * Removed nodes, and their data, are freed with epoch-based reclamation once
+ * no reader can still hold them, so the free function may be called some
+ * time after an element is removed.
+ *
+ * Nodes come from a per-table pool, carved from slabs one cache line per
+ * node, so inserting and expiring elements rarely touches malloc.  In
+ * intrusive mode each element carries its own node and the table allocates
+ * nothing per element; an element must then not be inserted again until the
+ * table has called its free function on it.
  */
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 
 #include "deltalist.h"
 
-struct delta_node {
-	const data_t *data;
-	unsigned int delta;         // delta for delta list
-	struct delta_node *ht_next; // hash table next pointer
-	struct delta_node *dl_next; // delta list next pointer
-	struct delta_node *dl_prev; // delta list prev pointer
+#define HT_MAX_LOAD 2
+#define HT_MIN_LOAD 8
+#define HT_REHASH_STEP 4 // non-empty buckets moved per insertion or removal
+#define HT_REHASH_SCAN 64 // empty buckets skipped per insertion or removal
+
+#define RECLAIM_BATCH 64  // removals between attempts to free removed nodes
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 5
+#define WHEEL_MAX_TTL ((1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+#define LOAD(x)     atomic_load_explicit(&(x), memory_order_relaxed)
+#define STORE(x, v) atomic_store_explicit(&(x), (v), memory_order_relaxed)
+
+#define CACHE_LINE 64
+#define SLAB_SIZE (16 * 1024) // bytes of nodes allocated at once
+
+typedef _Atomic(struct delta_node*) atomic_node_ptr;
+
+/* a node in a table's pool, padded to a cache line of its own */
+struct delta_slot {
+	union {
+		_Alignas(CACHE_LINE) struct delta_node node;
+		struct delta_slot *next;    // next free slot
+	};
 };
 
+struct delta_index {
+	struct delta_index *next;   // next retired table
+	unsigned long retired;      // epoch in which the table was replaced
+	unsigned long size;
+	atomic_node_ptr buckets[];
+};
+
+/* a shard of a struct sdelta_list, aligned so shards share no cache lines */
+struct delta_shard {
+	_Alignas(64) struct delta_list table;
+};
+
+struct delta_wheel {
+	unsigned long now;          // ticks elapsed
+	struct delta_node *slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+/*
+ * Epoch-based reclamation.  Each thread that reads a table without its lock
+ * has a record in which it announces the global epoch on entering the table
+ * and clears it on leaving.  The epoch only advances once every reader inside
+ * a table has announced the current value, so once it has advanced twice past
+ * the epoch in which a node was unlinked, no reader can still be looking at
+ * the node and it can be freed.
+ */
+struct ebr_thread {
+	atomic_ulong state;         // (epoch << 1) | 1 while reading, else 0
+	atomic_int in_use;
+	struct ebr_thread *next;
+};
+
+static atomic_ulong ebr_epoch = 1;
+static _Atomic(struct ebr_thread*) ebr_threads;
+static _Thread_local struct ebr_thread *ebr_self;
+
+static pthread_once_t ebr_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ebr_key;
+
+static void ebr_exit(void *data)
+{
+	struct ebr_thread *self = data;
+
+	STORE(self->state, 0);
+	atomic_store_explicit(&self->in_use, 0, memory_order_release);
+}
+
+static void ebr_init(void)
+{
+	pthread_key_create(&ebr_key, ebr_exit);
+}
+
+/*
+ * Returns the calling thread's record, claiming one the first time, or NULL
+ * if memory is exhausted.  Records are recycled when threads exit.
+ */
+static struct ebr_thread *ebr_register(void)
+{
+	struct ebr_thread *it;
+	int unused;
+
+	if (ebr_self)
+		return ebr_self;
+
+	pthread_once(&ebr_once, ebr_init);
+
+	for (it = atomic_load_explicit(&ebr_threads, memory_order_acquire); it;
+			it = it->next) {
+		unused = 0;
+		if (atomic_compare_exchange_strong(&it->in_use, &unused, 1))
+			goto found;
+	}
+
+	if (!(it = malloc(sizeof(struct ebr_thread))))
+		return NULL;
+	atomic_init(&it->state, 0);
+	atomic_init(&it->in_use, 1);
+
+	it->next = atomic_load_explicit(&ebr_threads, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&ebr_threads, &it->next,
+				it, memory_order_release,
+				memory_order_relaxed))
+		;
+found:
+	pthread_setspecific(ebr_key, it);
+	return ebr_self = it;
+}
+
+static void ebr_enter(struct ebr_thread *self)
+{
+	STORE(self->state, LOAD(ebr_epoch) << 1 | 1);
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void ebr_leave(struct ebr_thread *self)
+{
+	atomic_store_explicit(&self->state, 0, memory_order_release);
+}
+
+/*
+ * Advances the global epoch if every reader has seen the current one.
+ * Returns the global epoch.
+ */
+static unsigned long ebr_advance(void)
+{
+	struct ebr_thread *it;
+	unsigned long epoch, state;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	epoch = LOAD(ebr_epoch);
+
+	for (it = atomic_load_explicit(&ebr_threads, memory_order_acquire); it;
+			it = it->next) {
+		state = LOAD(it->state);
+		if ((state & 1) && state >> 1 != epoch)
+			return epoch;
+	}
+
+	if (atomic_compare_exchange_strong(&ebr_epoch, &epoch, epoch + 1))
+		return epoch + 1;
+	return epoch;
+}
+
+/*
+ * Returns a node for a new element: the one embedded in the element in
+ * intrusive mode, otherwise one from the table's pool.  The pool is refilled
+ * a slab at a time, so nodes are allocated in bulk and packed together, one
+ * per cache line.  Returns NULL if memory is exhausted.
+ */
+static struct delta_node *node_alloc(struct delta_list *table,
+		const data_t *data)
+{
+	struct delta_slot *slab;
+
+	if (table->intrusive)
+		return (struct delta_node*) ((char*) data + table->node_offset);
+
+	if (!table->free_nodes) {
+		if (!(slab = aligned_alloc(CACHE_LINE, SLAB_SIZE)))
+			return NULL;
+		for (size_t i = 0; i < SLAB_SIZE / sizeof(*slab); i++) {
+			slab[i].next = table->free_nodes;
+			table->free_nodes = &slab[i];
+		}
+	}
+
+	slab = table->free_nodes;
+	table->free_nodes = slab->next;
+	return &slab->node;
+}
+
+/*
+ * Returns a node to the table's pool.  Nodes embedded in elements are left
+ * alone.
+ */
+static void node_free(struct delta_list *table, struct delta_node *node)
+{
+	struct delta_slot *slot = (struct delta_slot*) node;
+
+	if (table->intrusive)
+		return;
+
+	slot->next = table->free_nodes;
+	table->free_nodes = slot;
+}
+
+/*
+ * Frees the removed nodes (and their data) and replaced hash tables that no
+ * reader can be looking at.  Called every tick as well as every
+ * RECLAIM_BATCH removals, so nothing waits for long once readers move on.
+ */
+static void ebr_reclaim(struct delta_list *table)
+{
+	struct delta_node *node;
+	struct delta_index *index, **pindex;
+	data_t *data;
+	unsigned long epoch;
+	int keep_data;
+
+	/* two advances are needed before anything retired now can go */
+	ebr_advance();
+	epoch = ebr_advance();
+
+	while ((node = table->retired_head) && epoch - node->retired >= 2) {
+		table->retired_head = node->dl_next;
+		table->nr_retired--;
+
+		data = (data_t*) node->data;
+		keep_data = node->keep_data;
+		node_free(table, node);
+		if (!keep_data)
+			table->free(data);
+	}
+
+	if (!table->retired_head)
+		table->retired_tail = NULL;
+
+	for (pindex = &table->retired_index; (index = *pindex); ) {
+		if (epoch - index->retired >= 2) {
+			*pindex = index->next;
+			free(index);
+		} else {
+			pindex = &index->next;
+		}
+	}
+}
+
+/*
+ * Queues a hash table which has been replaced to be freed once no reader can
+ * be looking at it.
+ */
+static void index_retire(struct delta_list *table, struct delta_index *index)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	index->retired = LOAD(ebr_epoch);
+	index->next = table->retired_index;
+	table->retired_index = index;
+}
+
+/*
+ * Queues a node which has been unlinked from the hash table to be freed
+ * once no reader can be looking at it.  The element is freed with it unless
+ * `keep_data' is set.  An embedded node kept with its element goes through
+ * the same grace period, since readers may still be walking its ht_next, but
+ * is never freed.
+ */
+static void node_retire(struct delta_list *table, struct delta_node *node,
+		int keep_data)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	node->retired = LOAD(ebr_epoch);
+	node->keep_data = keep_data;
+	node->dl_next = NULL;
+
+	if (table->retired_tail)
+		table->retired_tail->dl_next = node;
+	else
+		table->retired_head = node;
+	table->retired_tail = node;
+
+	if (++table->nr_retired % RECLAIM_BATCH == 0)
+		ebr_reclaim(table);
+}
+
+/*
+ * The hash table is rearranged (resized or rehashed) inside a write section
+ * of table->seq.  Lockless readers retry if the sequence number was odd or
+ * changed while they looked.  Insertions and removals don't need a write
+ * section, since a reader sees either the old or the new chain.
+ */
+static void seq_begin(struct delta_list *table)
+{
+	STORE(table->seq, LOAD(table->seq) + 1);
+	atomic_thread_fence(memory_order_release);
+}
+
+static void seq_end(struct delta_list *table)
+{
+	atomic_store_explicit(&table->seq, LOAD(table->seq) + 1,
+			memory_order_release);
+}
+
+static struct delta_index *index_alloc(unsigned long size)
+{
+	struct delta_index *index;
+
+	index = calloc(1, sizeof(struct delta_index)
+			+ size * sizeof(atomic_node_ptr));
+	if (index)
+		index->size = size;
+	return index;
+}
+
+/*
+ * Returns the bucket which holds elements with the given hash: the bucket in
+ * the old table if a rehash is in progress and that bucket has not been moved
+ * yet, otherwise the bucket in the current table.
+ */
+static atomic_node_ptr *get_bucket(struct delta_list *table,
+		unsigned long hash)
+{
+	struct delta_index *index;
+	unsigned long i;
+
+	index = atomic_load_explicit(&table->old_index, memory_order_acquire);
+	if (index) {
+		i = hash % index->size;
+		if (i >= LOAD(table->rehash_pos))
+			return &index->buckets[i];
+	}
+
+	index = atomic_load_explicit(&table->index, memory_order_acquire);
+	return &index->buckets[hash % index->size];
+}
+
+/*
+ * Moves up to HT_REHASH_STEP buckets from the old table to the current one,
+ * and frees the old table once it is empty.
+ */
+static void hash_rehash_step(struct delta_list *table)
+{
+	struct delta_index *old = LOAD(table->old_index);
+	struct delta_index *cur = LOAD(table->index);
+	struct delta_node *it, *next;
+	atomic_node_ptr *bucket;
+	unsigned long pos = LOAD(table->rehash_pos);
+	int moved = 0, scanned = 0;
+
+	seq_begin(table);
+
+	while (pos < old->size && moved < HT_REHASH_STEP
+			&& scanned < HT_REHASH_SCAN) {
+		if ((it = LOAD(old->buckets[pos])))
+			moved++;
+		else
+			scanned++;
+
+		for (; it; it = next) {
+			next = LOAD(it->ht_next);
+			bucket = &cur->buckets[it->hash % cur->size];
+			STORE(it->ht_next, LOAD(*bucket));
+			STORE(*bucket, it);
+		}
+		pos++;
+	}
+
+	STORE(table->rehash_pos, pos);
+	if (pos == old->size)
+		STORE(table->old_index, NULL);
+
+	seq_end(table);
+
+	if (pos == old->size)
+		index_retire(table, old);
+}
+
+/*
+ * Starts moving the table to `size' buckets.  If memory is exhausted the table
+ * keeps its current size, which is slower but still correct.
+ */
+static void hash_resize(struct delta_list *table, unsigned long size)
+{
+	struct delta_index *index;
+
+	if (!(index = index_alloc(size)))
+		return;
+
+	seq_begin(table);
+	STORE(table->rehash_pos, 0);
+	atomic_store_explicit(&table->old_index, LOAD(table->index),
+			memory_order_release);
+	atomic_store_explicit(&table->index, index, memory_order_release);
+	seq_end(table);
+}
+
+/*
+ * Does a bit of rehashing after an insertion or removal, and starts a resize
+ * if the table has become too full or too empty.
+ */
+static void hash_maintain(struct delta_list *table)
+{
+	unsigned long size = LOAD(table->index)->size;
+
+	if (LOAD(table->old_index)) {
+		hash_rehash_step(table);
+		return;
+	}
+
+	if (table->size > size * HT_MAX_LOAD)
+		hash_resize(table, size * 2);
+	else if (size > HT_SIZE && table->size < size / HT_MIN_LOAD)
+		hash_resize(table, size / 2 < HT_SIZE ? HT_SIZE : size / 2);
+}
+
 /*
  * Finds the struct delta_node associated with a given element, if that element
  * exists in the table.  If the element does not exist, NULL is returned. If
@@ -53,16 +478,15 @@ struct delta_node {
  * hash table bucket when this function returns.
  */
 static struct delta_node *get_node(struct delta_list *table,
-		const data_t *data, struct delta_node **prev)
+		const data_t *data, unsigned long hash, struct delta_node **prev)
 {
-	unsigned long index;
 	struct delta_node *it, *last;
 
-	index = table->hash(data) % HT_SIZE;
-
 	last = NULL;
-	for (it = table->table[index]; it; it = it->ht_next) {
-		if (table->equals(it->data, data))
+	it = atomic_load_explicit(get_bucket(table, hash), memory_order_acquire);
+	for (; it; it = atomic_load_explicit(&it->ht_next,
+				memory_order_acquire)) {
+		if (it->hash == hash && table->equals(it->data, data))
 			break;
 		last = it;
 	}
@@ -74,36 +498,56 @@ static struct delta_node *get_node(struct delta_list *table,
 }
 
 /*
- * Inserts a node into a bucket in the hash table.
+ * Inserts a node into a bucket in the hash table.  The node is published
+ * with a release store, so lockless readers see it fully initialized.
  */
-static void hash_insert(struct delta_list *table, struct delta_node *node)
+static void hash_insert(struct delta_list *table, struct delta_node *node,
+		unsigned long hash)
 {
-	unsigned long index = table->hash(node->data) % HT_SIZE;
+	atomic_node_ptr *bucket;
+
+	node->hash = hash;
+	bucket = get_bucket(table, hash);
 
-	node->ht_next = table->table[index];
-	table->table[index] = node;
+	STORE(node->ht_next, LOAD(*bucket));
+	atomic_store_explicit(bucket, node, memory_order_release);
 }
 
 /*
- * Inserts a node into the delta list.
+ * Inserts a node into the delta list, to expire after `ttl' ticks.  The list
+ * is searched backwards from the tail, so this is O(1) when `ttl' is at least
+ * the largest time-to-live in the list, which is always the case if every
+ * element uses table->interval.
  */
-static void dl_insert_node(struct delta_list *table, struct delta_node *node)
+static void dl_insert_node(struct delta_list *table, struct delta_node *node,
+		unsigned int ttl)
 {
-	node->delta = table->interval;
+	struct delta_node *it;
+	unsigned int t;
 
-	if (!table->delta_head) {
-		table->delta_head = table->delta_tail = node;
-		node->dl_prev = NULL;
-	} else {
-		node->delta -= table->delta;
+	/* find the last node that expires no later than `ttl' */
+	t = table->delta;
+	for (it = table->delta_tail; it && t > ttl; it = it->dl_prev)
+		t -= it->delta;
+
+	if (!it)
+		t = 0;
+	node->delta = ttl - t;
+	node->dl_prev = it;
+	node->dl_next = it ? it->dl_next : table->delta_head;
 
-		table->delta_tail->dl_next = node;
-		node->dl_prev = table->delta_tail;
+	if (node->dl_next) {
+		node->dl_next->delta -= node->delta;
+		node->dl_next->dl_prev = node;
+	} else {
 		table->delta_tail = node;
+		table->delta = ttl;
 	}
-	node->dl_next = NULL;
 
-	table->delta = table->interval;
+	if (it)
+		it->dl_next = node;
+	else
+		table->delta_head = node;
 }
 
 /*
@@ -116,6 +560,7 @@ static void dl_remove_node(struct delta_list *table, struct delta_node *node)
 		node->dl_next->dl_prev = node->dl_prev;
 	} else {
 		table->delta -= node->delta;
+		table->delta_tail = node->dl_prev;
 	}
 
 	if (node->dl_prev)
@@ -124,45 +569,158 @@ static void dl_remove_node(struct delta_list *table, struct delta_node *node)
 		table->delta_head = node->dl_next;
 }
 
+/*
+ * Links a node into the wheel slot for its expiry time.
+ */
+static void wheel_place(struct delta_wheel *wheel, struct delta_node *node)
+{
+	unsigned long diff = node->expires - wheel->now;
+	struct delta_node **slot;
+	int level;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (diff < 1UL << (WHEEL_BITS * (level + 1)))
+			break;
+	}
+	slot = &wheel->slots[level][(node->expires >> (WHEEL_BITS * level))
+		& WHEEL_MASK];
+
+	node->dl_next = *slot;
+	if (*slot)
+		(*slot)->wh_pprev = &node->dl_next;
+	node->wh_pprev = slot;
+	*slot = node;
+}
+
+/*
+ * Inserts a node into the timing wheel, to expire after `ttl' ticks.
+ */
+static void wheel_insert_node(struct delta_wheel *wheel,
+		struct delta_node *node, unsigned int ttl)
+{
+	node->expires = wheel->now + (ttl > WHEEL_MAX_TTL ? WHEEL_MAX_TTL : ttl);
+	wheel_place(wheel, node);
+}
+
+/*
+ * Removes a node from the timing wheel (but not the hash table).
+ */
+static void wheel_remove_node(struct delta_node *node)
+{
+	*node->wh_pprev = node->dl_next;
+	if (node->dl_next)
+		node->dl_next->wh_pprev = node->wh_pprev;
+}
+
+/*
+ * Schedules a node to expire after `ttl' ticks.
+ */
+static void timer_insert(struct delta_list *table, struct delta_node *node,
+		unsigned int ttl)
+{
+	if (!ttl)
+		ttl = 1;
+
+	if (table->engine == DELTA_ENGINE_WHEEL)
+		wheel_insert_node(table->wheel, node, ttl);
+	else
+		dl_insert_node(table, node, ttl);
+}
+
+/*
+ * Cancels a node's expiry.
+ */
+static void timer_remove(struct delta_list *table, struct delta_node *node)
+{
+	if (table->engine == DELTA_ENGINE_WHEEL)
+		wheel_remove_node(node);
+	else
+		dl_remove_node(table, node);
+}
+
 /*
  * Removes an element from the table.  Returns 0 on success, or -1 if the given
  * element is not in the table.
  */
-static int delta_delete(struct delta_list *table, const data_t *data)
+static int delta_delete(struct delta_list *table, const data_t *data,
+		unsigned long hash)
 {
-	unsigned long index;
 	struct delta_node *node, *prev;
 
-	if (!(node = get_node(table, data, &prev)))
+	if (!(node = get_node(table, data, hash, &prev)))
 		return -1;
 
 	/* remove from hash table */
-	if (prev) {
-		prev->ht_next = node->ht_next;
-	} else {
-		index = table->hash(data) % HT_SIZE;
-		table->table[index] = node->ht_next;
-	}
+	if (prev)
+		STORE(prev->ht_next, LOAD(node->ht_next));
+	else
+		STORE(*get_bucket(table, hash), LOAD(node->ht_next));
 
 	/* remove from delta list */
-	dl_remove_node(table, node);
+	timer_remove(table, node);
 
 	table->size--;
-	table->free((data_t*)node->data);
-	free(node);
+	node_retire(table, node, 0);
 
+	hash_maintain(table);
 	return 0;
 }
 
+/*
+ * Advances the timing wheel by one tick, redistributing the nodes of any
+ * higher-level slots that are now due and removing expired nodes.
+ */
+static void wheel_tick(struct delta_list *table)
+{
+	struct delta_wheel *wheel = table->wheel;
+	struct delta_node *it, *next, **slot;
+	data_t *tmp_data;
+
+	wheel->now++;
+
+	for (int level = 1; level < WHEEL_LEVELS; level++) {
+		if (wheel->now & ((1UL << (WHEEL_BITS * level)) - 1))
+			break;
+
+		slot = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level))
+			& WHEEL_MASK];
+		it = *slot;
+		*slot = NULL;
+		for (; it; it = next) {
+			next = it->dl_next;
+			wheel_place(wheel, it);
+		}
+	}
+
+	/* remove any expired elements */
+	slot = &wheel->slots[0][wheel->now & WHEEL_MASK];
+	while ((it = *slot)) {
+		tmp_data = (data_t*) it->data;
+
+		table->act(tmp_data);
+
+		delta_delete(table, tmp_data, it->hash);
+	}
+}
+
 /*
  * Increases "time" by one tick, removing expired nodes when appropriate.
  */
 static void delta_tick(struct delta_list *table)
 {
+	struct delta_node *node;
 	data_t *tmp_data;
 
 	pthread_mutex_lock(&table->lock);
 
+	ebr_reclaim(table);
+
+	if (table->engine == DELTA_ENGINE_WHEEL) {
+		wheel_tick(table);
+		pthread_mutex_unlock(&table->lock);
+		return;
+	}
+
 	if (!table->delta_head) {
 		pthread_mutex_unlock(&table->lock);
 		return;
@@ -172,12 +730,12 @@ static void delta_tick(struct delta_list *table)
 	table->delta_head->delta--;
 
 	/* remove any expired elements */
-	while (table->delta_head && !table->delta_head->delta) {
-		tmp_data = (data_t*) table->delta_head->data;
+	while ((node = table->delta_head) && !node->delta) {
+		tmp_data = (data_t*) node->data;
 
 		table->act(tmp_data);
 
-		delta_delete(table, tmp_data);
+		delta_delete(table, tmp_data, node->hash);
 	}
 	pthread_mutex_unlock(&table->lock);
 }
@@ -199,123 +757,254 @@ static _Noreturn void *clock_thread(void *data)
 	}
 }
 
-void delta_init(struct delta_list *table)
+/*
+ * Sets up everything but the clock thread.
+ */
+static void delta_setup(struct delta_list *table)
 {
-	pthread_t tid;
-
 	if (pthread_mutex_init(&table->lock, NULL))
 		perror("pthread_mutex_init");
-	if (pthread_create(&tid, NULL, clock_thread, table))
-		perror("pthread_create");
+	if (!(table->index = index_alloc(HT_SIZE)))
+		perror("calloc");
+	table->old_index = NULL;
+	table->rehash_pos = 0;
+	table->seq = 0;
+	table->retired_head = table->retired_tail = NULL;
+	table->nr_retired = 0;
+	table->retired_index = NULL;
+	table->free_nodes = NULL;
+
+	if (table->engine == DELTA_ENGINE_WHEEL
+			&& !(table->wheel = calloc(1, sizeof(struct delta_wheel)))) {
+		perror("calloc");
+		table->engine = DELTA_ENGINE_LIST;
+	}
 }
 
 /*
- * Inserts an element into the list IFF an element corresponding to the
- * argument isn't already in the list.
+ * The operations below take the element's hash, so that a sharded list can
+ * hash each element once to find both its shard and its bucket.
  */
-void delta_insert(struct delta_list *table, const data_t *data)
+
+static void table_insert(struct delta_list *table, const data_t *data,
+		unsigned long hash, unsigned int ttl)
 {
 	struct delta_node *node, *prev;
 
 	pthread_mutex_lock(&table->lock);
 
-	if (!(node = get_node(table, data, &prev))) {
-		node = malloc(sizeof(struct delta_node));
+	if (!(node = get_node(table, data, hash, &prev))
+			&& (node = node_alloc(table, data))) {
 		node->data = data;
-		hash_insert(table, node);
-		dl_insert_node(table, node);
+		hash_insert(table, node, hash);
+		timer_insert(table, node, ttl);
 		table->size++;
+		hash_maintain(table);
 	}
 
 	pthread_mutex_unlock(&table->lock);
 }
 
-/*
- * Relocates a node to the end of the list if the data corresponding to the
- * argument is already in the list; otherwise allocates a new node and puts it
- * at the end of the list.
- */
-int delta_update(struct delta_list *table, const data_t *data)
+static int table_update(struct delta_list *table, const data_t *data,
+		unsigned long hash, unsigned int ttl)
 {
 	struct delta_node *node, *prev;
 	int rc;
 
 	pthread_mutex_lock(&table->lock);
 
-	if ((node = get_node(table, data, &prev))) {
-		dl_remove_node(table, node);
+	if ((node = get_node(table, data, hash, &prev))) {
+		timer_remove(table, node);
 		rc = 1;
+	} else if (!(node = node_alloc(table, data))) {
+		pthread_mutex_unlock(&table->lock);
+		return -1;
 	} else {
-		node = malloc(sizeof(struct delta_node));
 		node->data = data;
-		hash_insert(table, node);
+		hash_insert(table, node, hash);
 		table->size++;
+		hash_maintain(table);
 		rc = 0;
 	}
-	dl_insert_node(table, node);
+	timer_insert(table, node, ttl);
 
 	pthread_mutex_unlock(&table->lock);
 
 	return rc;
 }
 
-/*
- * Thread-safe interface to delta_delete().
- */
-int delta_remove(struct delta_list *table, const data_t *data)
+static int table_remove(struct delta_list *table, const data_t *data,
+		unsigned long hash)
 {
 	int rc;
 
 	pthread_mutex_lock(&table->lock);
-	rc = delta_delete(table, data);
+	rc = delta_delete(table, data, hash);
 	pthread_mutex_unlock(&table->lock);
 
 	return rc;
 }
 
+/*
+ * Looks an element up without taking the table's lock.  Falls back to the
+ * lock only if the thread can't be registered as a reader.
+ */
+static const data_t *table_get(struct delta_list *table, const data_t *data,
+		unsigned long hash)
+{
+	struct ebr_thread *self;
+	struct delta_node *node;
+	const data_t *rv;
+	unsigned int seq;
+
+	if (!(self = ebr_register())) {
+		pthread_mutex_lock(&table->lock);
+		node = get_node(table, data, hash, NULL);
+		rv = node ? node->data : NULL;
+		pthread_mutex_unlock(&table->lock);
+		return rv;
+	}
+
+	ebr_enter(self);
+	do {
+		while ((seq = atomic_load_explicit(&table->seq,
+						memory_order_acquire)) & 1)
+			sched_yield();
+
+		node = get_node(table, data, hash, NULL);
+		rv = node ? node->data : NULL;
+
+		atomic_thread_fence(memory_order_acquire);
+	} while (LOAD(table->seq) != seq);
+	ebr_leave(self);
+
+	return rv;
+}
+
+void delta_init(struct delta_list *table)
+{
+	pthread_t tid;
+
+	delta_setup(table);
+	if (pthread_create(&tid, NULL, clock_thread, table))
+		perror("pthread_create");
+}
+
+/*
+ * Inserts an element into the list IFF an element corresponding to the
+ * argument isn't already in the list.
+ */
+void delta_insert(struct delta_list *table, const data_t *data)
+{
+	table_insert(table, data, table->hash(data), table->interval);
+}
+
+/*
+ * Inserts an element which expires after `ttl' ticks, rather than the table's
+ * interval, IFF an element corresponding to the argument isn't already in the
+ * list.
+ */
+void delta_insert_ttl(struct delta_list *table, const data_t *data,
+		unsigned int ttl)
+{
+	table_insert(table, data, table->hash(data), ttl);
+}
+
+/*
+ * Relocates a node to the end of the list if the data corresponding to the
+ * argument is already in the list; otherwise allocates a new node and puts it
+ * at the end of the list.  Returns 1 if the element was already in the list,
+ * 0 if it was added, or -1 if memory is exhausted.
+ */
+int delta_update(struct delta_list *table, const data_t *data)
+{
+	return table_update(table, data, table->hash(data), table->interval);
+}
+
+/*
+ * As delta_update(), but the element expires after `ttl' ticks rather than
+ * the table's interval.
+ */
+int delta_update_ttl(struct delta_list *table, const data_t *data,
+		unsigned int ttl)
+{
+	return table_update(table, data, table->hash(data), ttl);
+}
+
+/*
+ * Removes an element from the table.  Returns 0 on success, or -1 if the given
+ * element is not in the table.
+ */
+int delta_remove(struct delta_list *table, const data_t *data)
+{
+	return table_remove(table, data, table->hash(data));
+}
+
 /*
  * Returns true if the given element exists in the table, or false if it does
  * not.
  */
 int delta_contains(struct delta_list *table, const data_t *data)
 {
-	pthread_mutex_lock(&table->lock);
-	struct delta_node *rv = get_node(table, data, NULL);
-	pthread_mutex_unlock(&table->lock);
-
-	return rv ? 1 : 0;
+	return table_get(table, data, table->hash(data)) ? 1 : 0;
 }
 
 /*
  * Returns the element in the table equal to the given value (equal being
  * defined by the function dh_equals) if such an element exists.  Otherwise
- * returns NULL.
+ * returns NULL.  The element is freed once it has been removed and no
+ * lookup can still be using it, so the caller must not use it after it may
+ * have been removed.
  */
 const data_t *delta_get(struct delta_list *table, const data_t *data)
 {
-	struct delta_node *node;
-
-	pthread_mutex_lock(&table->lock);
-	node = get_node(table, data, NULL);
-	pthread_mutex_unlock(&table->lock);
-
-	return node ? node->data : NULL;
+	return table_get(table, data, table->hash(data));
 }
 
 /*
- * Empties the table.
+ * Empties the table.  The elements are not freed, but the call waits until no
+ * lockless reader can still be looking at them (or, in intrusive mode, at
+ * their nodes), so the caller may free or reuse them once it returns.
  */
 void delta_clear(struct delta_list *table)
 {
 	struct delta_node *it, *tmp;
+	struct delta_index *index, *old;
 
 	pthread_mutex_lock(&table->lock);
 
+	/* unlink everything; lockless readers may still hold the nodes */
+	index = LOAD(table->index);
+	old = LOAD(table->old_index);
+
+	seq_begin(table);
+	for (unsigned long i = 0; i < index->size; i++)
+		STORE(index->buckets[i], NULL);
+	STORE(table->old_index, NULL);
+	seq_end(table);
+
+	if (old)
+		index_retire(table, old);
+
 	it = table->delta_head;
 	while (it) {
 		tmp = it;
 		it = it->dl_next;
-		free(tmp);
+		node_retire(table, tmp, 1);
+	}
+
+	if (table->engine == DELTA_ENGINE_WHEEL) {
+		for (int i = 0; i < WHEEL_LEVELS; i++) {
+			for (int j = 0; j < WHEEL_SIZE; j++) {
+				it = table->wheel->slots[i][j];
+				while (it) {
+					tmp = it;
+					it = it->dl_next;
+					node_retire(table, tmp, 1);
+				}
+				table->wheel->slots[i][j] = NULL;
+			}
+		}
 	}
 
 	table->size = 0;
@@ -323,15 +1012,18 @@ void delta_clear(struct delta_list *table)
 	table->delta_head = NULL;
 	table->delta_tail = NULL;
 
-	for (int i = 0; i < HT_SIZE; i++)
-		table->table[i] = NULL;
+	/* readers don't take the lock, so they can't hold this up for long */
+	for (ebr_reclaim(table); table->retired_head; ebr_reclaim(table))
+		sched_yield();
 
 	pthread_mutex_unlock(&table->lock);
 }
 
 /*
  * Calls the function `fun' on each element in the list.  A non-zero return
- * value from `fun' is taken to indicate that iteration should cease.
+ * value from `fun' is taken to indicate that iteration should cease.  With the
+ * delta list, elements are visited in order of expiry; with the timing wheel
+ * the order is unspecified.
  */
 void delta_foreach(struct delta_list *table,
 		int (*fun)(const data_t *it, void *arg), void *arg)
@@ -339,10 +1031,23 @@ void delta_foreach(struct delta_list *table,
 	struct delta_node *it;
 
 	pthread_mutex_lock(&table->lock);
-	for (it = table->delta_head; it; it = it->dl_next) {
-		if (fun(it->data, arg))
-			break;
+	if (table->engine == DELTA_ENGINE_WHEEL) {
+		for (int i = 0; i < WHEEL_LEVELS; i++) {
+			for (int j = 0; j < WHEEL_SIZE; j++) {
+				for (it = table->wheel->slots[i][j]; it;
+						it = it->dl_next) {
+					if (fun(it->data, arg))
+						goto out;
+				}
+			}
+		}
+	} else {
+		for (it = table->delta_head; it; it = it->dl_next) {
+			if (fun(it->data, arg))
+				break;
+		}
 	}
+out:
 	pthread_mutex_unlock(&table->lock);
 }
 
@@ -357,3 +1062,169 @@ unsigned int delta_size(struct delta_list *table)
 	pthread_mutex_unlock(&table->lock);
 	return rv;
 }
+
+/*
+ * Clock thread for a sharded list: every list->resolution seconds, advances
+ * each shard by one tick in turn.
+ */
+static _Noreturn void *sdelta_clock_thread(void *data)
+{
+	struct sdelta_list *list = data;
+	unsigned int left;
+
+	pthread_detach(pthread_self());
+
+	for (;;) {
+		for (left = list->resolution; left; left = sleep(left))
+			;
+		for (unsigned int i = 0; i < list->nr_shards; i++)
+			delta_tick(&list->shards[i].table);
+	}
+}
+
+/*
+ * Returns the shard for an element with the given hash.  The shard is chosen
+ * by the high bits of a multiplicative hash, so that it is independent of the
+ * bucket (hash % nr_buckets) the element falls in within the shard.
+ */
+static struct delta_list *sdelta_shard(struct sdelta_list *list,
+		unsigned long hash)
+{
+	uint64_t mixed = (uint64_t) hash * 0x9e3779b97f4a7c15ULL;
+
+	return &list->shards[(mixed >> 32) % list->nr_shards].table;
+}
+
+void sdelta_init(struct sdelta_list *list)
+{
+	pthread_t tid;
+
+	if (!list->nr_shards)
+		list->nr_shards = SDELTA_SHARDS;
+
+	list->shards = aligned_alloc(_Alignof(struct delta_shard),
+			list->nr_shards * sizeof(struct delta_shard));
+	if (!list->shards) {
+		perror("aligned_alloc");
+		return;
+	}
+
+	for (unsigned int i = 0; i < list->nr_shards; i++) {
+		struct delta_list shard = {
+			.resolution  = list->resolution,
+			.interval    = list->interval,
+			.engine      = list->engine,
+			.intrusive   = list->intrusive,
+			.node_offset = list->node_offset,
+			.hash        = list->hash,
+			.equals      = list->equals,
+			.act         = list->act,
+			.free        = list->free,
+		};
+		memcpy(&list->shards[i].table, &shard, sizeof(shard));
+		delta_setup(&list->shards[i].table);
+	}
+
+	if (pthread_create(&tid, NULL, sdelta_clock_thread, list))
+		perror("pthread_create");
+}
+
+void sdelta_insert(struct sdelta_list *list, const data_t *data)
+{
+	unsigned long hash = list->hash(data);
+
+	table_insert(sdelta_shard(list, hash), data, hash, list->interval);
+}
+
+void sdelta_insert_ttl(struct sdelta_list *list, const data_t *data,
+		unsigned int ttl)
+{
+	unsigned long hash = list->hash(data);
+
+	table_insert(sdelta_shard(list, hash), data, hash, ttl);
+}
+
+int sdelta_update(struct sdelta_list *list, const data_t *data)
+{
+	unsigned long hash = list->hash(data);
+
+	return table_update(sdelta_shard(list, hash), data, hash,
+			list->interval);
+}
+
+int sdelta_update_ttl(struct sdelta_list *list, const data_t *data,
+		unsigned int ttl)
+{
+	unsigned long hash = list->hash(data);
+
+	return table_update(sdelta_shard(list, hash), data, hash, ttl);
+}
+
+int sdelta_remove(struct sdelta_list *list, const data_t *data)
+{
+	unsigned long hash = list->hash(data);
+
+	return table_remove(sdelta_shard(list, hash), data, hash);
+}
+
+int sdelta_contains(struct sdelta_list *list, const data_t *data)
+{
+	return sdelta_get(list, data) ? 1 : 0;
+}
+
+const data_t *sdelta_get(struct sdelta_list *list, const data_t *data)
+{
+	unsigned long hash = list->hash(data);
+
+	return table_get(sdelta_shard(list, hash), data, hash);
+}
+
+/*
+ * Empties each shard in turn, as delta_clear().  Elements inserted into an
+ * already emptied shard while this runs are kept.
+ */
+void sdelta_clear(struct sdelta_list *list)
+{
+	for (unsigned int i = 0; i < list->nr_shards; i++)
+		delta_clear(&list->shards[i].table);
+}
+
+struct sdelta_foreach_arg {
+	int (*fun)(const data_t *it, void *arg);
+	void *arg;
+	int stop;
+};
+
+static int sdelta_foreach_fun(const data_t *it, void *arg)
+{
+	struct sdelta_foreach_arg *a = arg;
+
+	return a->stop = a->fun(it, a->arg);
+}
+
+/*
+ * Calls the function `fun' on each element in the list, one shard at a time.
+ * A non-zero return value from `fun' is taken to indicate that iteration
+ * should cease.
+ */
+void sdelta_foreach(struct sdelta_list *list,
+		int (*fun)(const data_t *it, void *arg), void *arg)
+{
+	struct sdelta_foreach_arg a = { .fun = fun, .arg = arg, .stop = 0 };
+
+	for (unsigned int i = 0; i < list->nr_shards && !a.stop; i++)
+		delta_foreach(&list->shards[i].table, sdelta_foreach_fun, &a);
+}
+
+/*
+ * Returns the number of elements in the list.  The shards are counted one at
+ * a time, so the result is only exact if the list is not being modified.
+ */
+unsigned int sdelta_size(struct sdelta_list *list)
+{
+	unsigned int rv = 0;
+
+	for (unsigned int i = 0; i < list->nr_shards; i++)
+		rv += delta_size(&list->shards[i].table);
+	return rv;
+}
@@ -18,24 +18,73 @@
 #ifndef _PSNET_DELTALIST_H_
 #define _PSNET_DELTALIST_H_
 
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* initial (and minimum) number of hash buckets */
 #ifndef HT_SIZE
 #define HT_SIZE 10
 #endif
 
+/* default number of shards in a struct sdelta_list */
+#ifndef SDELTA_SHARDS
+#define SDELTA_SHARDS 16
+#endif
+
 /*
  * The delta list stores pointers to data_t.  This may be changed to another
  * data type if a bit of type-safety is in order.
  */
 typedef void data_t;
 
+/*
+ * The table's record of an element.  Normally these are allocated by the
+ * table, from a pool.  In intrusive mode (table->intrusive set) the caller
+ * embeds one in each data_t, at table->node_offset, and the table allocates
+ * nothing.  The node belongs to the table from insertion until the table's
+ * free function is called on the element, and its contents are private.
+ */
+struct delta_node {
+	const data_t *data;
+	unsigned long hash;
+	union {
+		unsigned int delta;         // delta for delta list
+		unsigned long expires;      // expiry tick for timing wheel
+		unsigned long retired;      // epoch in which the node was removed
+	};
+	_Atomic(struct delta_node*) ht_next; // hash table next pointer
+	struct delta_node *dl_next; // delta list, wheel slot or retired list
+	union {
+		struct delta_node *dl_prev;   // delta list prev pointer
+		struct delta_node **wh_pprev; // pointer to this node in its slot
+		int keep_data;                // retired without its element
+	};
+};
+
+/*
+ * How expiry times are kept.  The delta list makes insertion O(1) when every
+ * element has the same time-to-live, but inserting with any other TTL walks
+ * the list.  The timing wheel makes insertion, refreshing and removal O(1)
+ * for any mix of TTLs, at the cost of a fixed-size table and a little work on
+ * every tick.
+ */
+enum delta_engine {
+	DELTA_ENGINE_LIST,
+	DELTA_ENGINE_WHEEL,
+};
+
 struct delta_list {
 	unsigned int resolution;       // seconds per tick
-	unsigned int interval;         // ticks per time-to-live
+	unsigned int interval;         // ticks per time-to-live (default)
+	enum delta_engine engine;
+	int intrusive;                 // data_t embeds its struct delta_node
+	size_t node_offset;            // offset of the node within data_t
 	unsigned int size;             // number of elements in the list
 	unsigned int delta;            // sum of all individual deltas
 
 	struct delta_node *delta_head; // head of the delta list
 	struct delta_node *delta_tail; // tail of the delta list
+	struct delta_wheel *wheel;     // timing wheel, for DELTA_ENGINE_WHEEL
 
 	/* functions that operate on data_t */
 	unsigned long (* const hash)(const data_t*);
@@ -45,12 +94,28 @@ struct delta_list {
 
 	pthread_mutex_t lock;
 
-	struct delta_node *table[HT_SIZE]; // memory for the hash table
+	/* hash table, resized as elements are added and removed */
+	_Atomic(struct delta_index*) index;
+	_Atomic(struct delta_index*) old_index; // table being rehashed, or NULL
+	atomic_ulong rehash_pos;       // next bucket of old_index to move
+	atomic_uint seq;               // odd while the table is rearranged
+
+	/* removed nodes, freed once no lockless reader can hold them */
+	struct delta_node *retired_head;
+	struct delta_node *retired_tail;
+	unsigned long nr_retired;
+	struct delta_index *retired_index; // replaced hash tables
+
+	struct delta_slot *free_nodes; // node pool
 };
 
 void delta_init(struct delta_list *table);
 void delta_insert(struct delta_list *table, const data_t *data);
+void delta_insert_ttl(struct delta_list *table, const data_t *data,
+		unsigned int ttl);
 int delta_update(struct delta_list *table, const data_t *data);
+int delta_update_ttl(struct delta_list *table, const data_t *data,
+		unsigned int ttl);
 int delta_remove(struct delta_list *table, const data_t *data);
 int delta_contains(struct delta_list *table, const data_t *data);
 const data_t *delta_get(struct delta_list *table, const data_t *data);
@@ -58,4 +123,43 @@ void delta_clear(struct delta_list *table);
 void delta_foreach(struct delta_list *table,
 		int (*fun)(const data_t *it, void *arg), void *arg);
 unsigned int delta_size(struct delta_list *table);
+
+/*
+ * A delta list split into shards, each an independent struct delta_list with
+ * its own lock, hash table and timers.  Elements are assigned to shards by
+ * hash, so operations on different shards never contend.  A single clock
+ * thread expires the shards one at a time, so a mass expiry only holds up
+ * operations on the shard being swept.
+ */
+struct sdelta_list {
+	unsigned int resolution;       // seconds per tick
+	unsigned int interval;         // ticks per time-to-live (default)
+	enum delta_engine engine;
+	int intrusive;                 // data_t embeds its struct delta_node
+	size_t node_offset;            // offset of the node within data_t
+	unsigned int nr_shards;        // 0 for SDELTA_SHARDS
+
+	/* functions that operate on data_t */
+	unsigned long (* const hash)(const data_t*);
+	int (* const equals)(const data_t*,const data_t*);
+	void (* const act)(const data_t*);
+	void (* const free)(data_t*);
+
+	struct delta_shard *shards;
+};
+
+void sdelta_init(struct sdelta_list *list);
+void sdelta_insert(struct sdelta_list *list, const data_t *data);
+void sdelta_insert_ttl(struct sdelta_list *list, const data_t *data,
+		unsigned int ttl);
+int sdelta_update(struct sdelta_list *list, const data_t *data);
+int sdelta_update_ttl(struct sdelta_list *list, const data_t *data,
+		unsigned int ttl);
+int sdelta_remove(struct sdelta_list *list, const data_t *data);
+int sdelta_contains(struct sdelta_list *list, const data_t *data);
+const data_t *sdelta_get(struct sdelta_list *list, const data_t *data);
+void sdelta_clear(struct sdelta_list *list);
+void sdelta_foreach(struct sdelta_list *list,
+		int (*fun)(const data_t *it, void *arg), void *arg);
+unsigned int sdelta_size(struct sdelta_list *list);
 #endif
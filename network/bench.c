@@ -0,0 +1,310 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* bench.c
+ *
+ * Throughput and system calls per message of each framing function in
+ * network.c, over a socketpair with the sender in another thread, and of
+ * netstring_scan() over the same frames in memory.  The syscall counts are
+ * the METRIC_SYSCALLS_* counters, which both ends bump in this process, so
+ * they are exact:
+ *
+ *   cc -O2 bench.c network.c netscan.c msgbuf.c metrics.c -lpthread
+ *   ./a.out [message size [messages]]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+#include "network.h"
+#include "netscan.h"
+
+static void make_socketpair(int sv[2])
+{
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		perror("socketpair");
+		exit(EXIT_FAILURE);
+	}
+}
+
+#define BENCH_BATCH 64
+
+struct bench_case {
+	const char *name;
+	void (*send)(int sock, const char *msg, size_t len, unsigned long n);
+	int (*recv)(int sock, size_t len, unsigned long n);
+};
+
+struct bench_sender {
+	pthread_t tid;
+	const struct bench_case *bc;
+	int sock;
+	const char *msg;
+	size_t len;
+	unsigned long n;
+};
+
+static void send_raw(int sock, const char *msg, size_t len, unsigned long n)
+{
+	while (n--)
+		tcp_send_bytes(sock, msg, len);
+}
+
+static void send_netstring(int sock, const char *msg, size_t len,
+		unsigned long n)
+{
+	while (n--)
+		netstring_send(sock, len, msg);
+}
+
+static void send_corked(int sock, const char *msg, size_t len,
+		unsigned long n)
+{
+	struct tcp_cork c;
+
+	if (tcp_cork_init(&c, sock, 64 * 1024))
+		return;
+	while (n--)
+		tcp_cork_netstring(&c, len, msg);
+	tcp_cork_flush(&c);
+	tcp_cork_destroy(&c);
+}
+
+static void send_varint(int sock, const char *msg, size_t len,
+		unsigned long n)
+{
+	while (n--)
+		varint_send(sock, len, msg);
+}
+
+static int recv_raw(int sock, size_t len, unsigned long n)
+{
+	char *buf = malloc(len);
+	int rc = 0;
+
+	while (n-- && !rc)
+		rc = tcp_read_bytes(sock, buf, len) != (ssize_t) len;
+	free(buf);
+	return rc;
+}
+
+static int recv_nb(int sock, size_t len, unsigned long n)
+{
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+	char *buf = malloc(len);
+	struct tcp_io io;
+	ssize_t rv = 0;
+
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	while (n-- && !rv) {
+		tcp_io_buf(&io, buf, len);
+		while ((rv = tcp_recv_nb(sock, &io)) > 0)
+			poll(&pfd, 1, -1);
+	}
+	free(buf);
+	return rv < 0 ? -1 : 0;
+}
+
+/* a reader of whole frames into new buffers */
+static int recv_alloc(ssize_t (*rd)(int, char**), int sock, size_t len,
+		unsigned long n)
+{
+	char *data;
+
+	while (n--) {
+		if (rd(sock, &data) != (ssize_t) len)
+			return -1;
+		free(data);
+	}
+	return 0;
+}
+
+static int recv_netstring(int sock, size_t len, unsigned long n)
+{
+	return recv_alloc(netstring_read, sock, len, n);
+}
+
+static int recv_varint(int sock, size_t len, unsigned long n)
+{
+	return recv_alloc(varint_read, sock, len, n);
+}
+
+static int recv_frame(int sock, size_t len, unsigned long n)
+{
+	return recv_alloc(frame_read, sock, len, n);
+}
+
+static int recv_reader(int sock, size_t len, unsigned long n)
+{
+	struct netstring_reader r;
+	char *data;
+	int rc = 0;
+
+	if (netstring_reader_init(&r, sock, 64 * 1024))
+		return -1;
+	while (n-- && !rc) {
+		rc = netstring_reader_read(&r, &data) != (ssize_t) len;
+		if (!rc)
+			free(data);
+	}
+	netstring_reader_destroy(&r);
+	return rc;
+}
+
+static int recv_batch(int sock, size_t len, unsigned long n)
+{
+	struct netstring_view views[BENCH_BATCH];
+	struct netstring_reader r;
+	ssize_t rv;
+
+	if (netstring_reader_init(&r, sock, 64 * 1024))
+		return -1;
+	while (n) {
+		rv = netstring_reader_batch(&r, views, BENCH_BATCH);
+		if (rv <= 0 || views[0].len != len)
+			break;
+		n -= rv;
+	}
+	netstring_reader_destroy(&r);
+	return n ? -1 : 0;
+}
+
+static const struct bench_case bench_cases[] = {
+	{ "tcp_read_bytes",                send_raw,       recv_raw       },
+	{ "tcp_recv_nb",                   send_raw,       recv_nb        },
+	{ "netstring_read",                send_netstring, recv_netstring },
+	{ "netstring_reader_read",         send_netstring, recv_reader    },
+	{ "netstring_reader_batch",        send_netstring, recv_batch     },
+	{ "netstring_reader_batch, corked", send_corked,   recv_batch     },
+	{ "varint_read",                   send_varint,    recv_varint    },
+	{ "frame_read",                    send_varint,    recv_frame     },
+};
+
+/*
+ * Times netstring_scan() over `n' netstrings already in memory, in batches
+ * of BENCH_BATCH.  Returns the elapsed time in seconds, or -1.
+ */
+static double bench_scan(const char *msg, size_t len, unsigned long n)
+{
+	struct netstring_frame frames[BENCH_BATCH];
+	struct timespec t0, t1;
+	size_t off = 0, used, hdr;
+	unsigned long got = 0;
+	char *buf;
+	ssize_t rv;
+
+	hdr = snprintf(NULL, 0, "%zu:", len);
+	if (!(buf = malloc(n * (hdr + len + 1))))
+		return -1;
+	for (unsigned long i = 0; i < n; i++) {
+		off += sprintf(buf + off, "%zu:", len);
+		memcpy(buf + off, msg, len);
+		off += len;
+		buf[off++] = ',';
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (size_t pos = 0; (rv = netstring_scan(buf + pos, off - pos, frames,
+					BENCH_BATCH, &used)) > 0; pos += used)
+		got += rv;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	free(buf);
+	if (got != n)
+		return -1;
+	return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+static void *bench_sender_main(void *data)
+{
+	struct bench_sender *s = data;
+
+	s->bc->send(s->sock, s->msg, s->len, s->n);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t len = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+	unsigned long n = argc > 2 ? strtoul(argv[2], NULL, 10) : 200000;
+	struct metrics before, after;
+	struct bench_sender s;
+	struct timespec t0, t1;
+	double secs;
+	char *msg;
+	int sv[2], rc;
+
+	if (!len || !n || !(msg = malloc(len)))
+		return EXIT_FAILURE;
+	/* no leading '0', which would end a netstring stream */
+	memset(msg, 'x', len);
+
+	printf("%lu messages of %zu bytes\n", n, len);
+	printf("%-32s %10s %10s %8s %8s\n", "", "msgs/s", "MB/s",
+			"recv/msg", "send/msg");
+
+	for (size_t i = 0; i < sizeof(bench_cases)/sizeof(*bench_cases); i++) {
+		make_socketpair(sv);
+		s.bc = &bench_cases[i];
+		s.sock = sv[1];
+		s.msg = msg;
+		s.len = len;
+		s.n = n;
+
+		metrics_snapshot(&before);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (pthread_create(&s.tid, NULL, bench_sender_main, &s)) {
+			perror("pthread_create");
+			return EXIT_FAILURE;
+		}
+		rc = bench_cases[i].recv(sv[0], len, n);
+		close(sv[0]);
+		pthread_join(s.tid, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		metrics_snapshot(&after);
+		close(sv[1]);
+
+		if (rc) {
+			printf("%-32s failed\n", bench_cases[i].name);
+			continue;
+		}
+		secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		printf("%-32s %10.0f %10.1f %8.2f %8.2f\n",
+				bench_cases[i].name, n / secs,
+				n * len / secs / 1e6,
+				(double) (after.counters[METRIC_SYSCALLS_IN]
+				- before.counters[METRIC_SYSCALLS_IN]) / n,
+				(double) (after.counters[METRIC_SYSCALLS_OUT]
+				- before.counters[METRIC_SYSCALLS_OUT]) / n);
+	}
+
+	if ((secs = bench_scan(msg, len, n)) < 0)
+		printf("%-32s failed\n", "netstring_scan");
+	else
+		printf("%-32s %10.0f %10.1f %8.2f %8.2f\n", "netstring_scan",
+				n / secs, n * len / secs / 1e6, 0.0, 0.0);
+	free(msg);
+	return EXIT_SUCCESS;
+}
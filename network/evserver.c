@@ -0,0 +1,1155 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _GNU_SOURCE /* accept4 */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <syslog.h>
+
+#include "ipv6.h"
+#include "evserver.h"
+
+/* evserver.c
+ *
+ * This file implements an event-driven TCP server.  Rather than spawning a
+ * thread per connection, a single thread multiplexes every connection and
+ * invokes callbacks when a socket becomes readable or writable.  The only
+ * per-connection cost is a struct ev_conn and a file descriptor, so idle
+ * connections are cheap.
+ *
+ * There are two backends.  The epoll backend uses edge-triggered epoll.  The
+ * io_uring backend uses a multishot accept for the listening socket, and
+ * either a multishot poll or (if the user supplies a `recv' callback) a
+ * multishot receive into provided buffers for each connection, so that one
+ * io_uring_enter() call both submits and reaps a whole batch of work.  Output
+ * queued with ev_send() is submitted as a chain of linked sends.  The
+ * io_uring backend needs Linux 5.19; before 6.0 receives are single-shot and
+ * re-armed after each completion.
+ *
+ * Only servers written against struct ev_ops get the io_uring backend.  The
+ * callbacks of tcp_server_main() and udp_server_main() in server.c are thread
+ * start routines that own their socket and block on it, so those entry points
+ * keep their blocking threads, and there is no io_uring path for UDP.
+ *
+ * Each connection has an idle, a read and a write timer, so that slow or dead
+ * peers are dropped without a thread blocking on them.  All timers of a kind
+ * share one interval, so a restarted timer always expires after every other
+ * timer of its kind: each kind is kept in a FIFO list that is sorted by
+ * construction, and starting, stopping and expiring a timer are O(1).  The
+ * loop sleeps until the earliest deadline at the head of the three lists.
+ */
+
+#define EV_MAX_EVENTS 256
+#define EV_RECV_SIZE  16384
+
+#define EV_URING_ENTRIES 1024
+#define EV_URING_BUFS    1024
+#define EV_URING_BUFSIZE 4096
+
+/* io_uring user_data tags, stored in the low bits of the pointer */
+#define EV_TAG_ACCEPT  0
+#define EV_TAG_POLL    1
+#define EV_TAG_POLLOUT 2
+#define EV_TAG_RECV    3
+#define EV_TAG_SEND    4
+#define EV_TAG_CANCEL  5
+#define EV_TAG_TIMER   6
+#define EV_TAG_MASK    7
+
+/* ev_conn flags */
+#define EV_CONN_CLOSED     (1 << 0)
+#define EV_CONN_WANT_WRITE (1 << 1) // user asked for `writable'
+#define EV_CONN_POLLOUT    (1 << 2) // POLLOUT request in flight
+#define EV_CONN_SENDQ      (1 << 3) // on the loop's send list
+
+/*
+ * A chunk of output queued by ev_send().
+ */
+struct ev_buf {
+	struct ev_buf *next;
+	struct ev_conn *conn;
+	size_t len;
+	size_t off;                // bytes already sent (epoll)
+	int submitted;             // send is in flight (io_uring)
+	char data[];
+};
+
+static inline uint64_t ev_tag(void *ptr, int tag)
+{
+	return (uintptr_t) ptr | tag;
+}
+
+/*
+ * Returns the current time in milliseconds.
+ */
+static uint64_t ev_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline struct ev_conn *ev_timer_conn(struct ev_timer *timer, int kind)
+{
+	return (struct ev_conn*) ((char*) (timer - kind)
+			- offsetof(struct ev_conn, timers));
+}
+
+static void ev_timer_stop(struct ev_conn *conn, int kind)
+{
+	struct ev_timer_list *list = &conn->loop->timers[kind];
+	struct ev_timer *timer = &conn->timers[kind];
+
+	if (!timer->deadline)
+		return;
+
+	if (timer->prev)
+		timer->prev->next = timer->next;
+	else
+		list->head = timer->next;
+	if (timer->next)
+		timer->next->prev = timer->prev;
+	else
+		list->tail = timer->prev;
+	timer->deadline = 0;
+}
+
+/*
+ * (Re)starts a timer.  Since every timer of a kind has the same interval,
+ * appending it keeps the list sorted.
+ */
+static void ev_timer_start(struct ev_conn *conn, int kind)
+{
+	struct ev_loop *loop = conn->loop;
+	struct ev_timer_list *list = &loop->timers[kind];
+	struct ev_timer *timer = &conn->timers[kind];
+
+	if (!loop->timeout[kind] || (conn->flags & EV_CONN_CLOSED))
+		return;
+
+	ev_timer_stop(conn, kind);
+	timer->deadline = loop->now + loop->timeout[kind];
+	timer->next = NULL;
+	timer->prev = list->tail;
+	if (list->tail)
+		list->tail->next = timer;
+	else
+		list->head = timer;
+	list->tail = timer;
+}
+
+/*
+ * Restarts the idle and read timers after input arrived.
+ */
+static void ev_touch_input(struct ev_conn *conn)
+{
+	ev_timer_start(conn, EV_TIMER_IDLE);
+	ev_timer_start(conn, EV_TIMER_READ);
+}
+
+/*
+ * Restarts the idle and write timers after output was sent.  The write timer
+ * only runs while output is queued.
+ */
+static void ev_touch_output(struct ev_conn *conn)
+{
+	ev_timer_start(conn, EV_TIMER_IDLE);
+	if (conn->wq_head)
+		ev_timer_start(conn, EV_TIMER_WRITE);
+	else
+		ev_timer_stop(conn, EV_TIMER_WRITE);
+}
+
+/*
+ * Returns the earliest deadline of any timer, or UINT64_MAX if none is
+ * armed.
+ */
+static uint64_t ev_next_deadline(struct ev_loop *loop)
+{
+	uint64_t next = UINT64_MAX;
+
+	for (int i = 0; i < EV_NR_TIMERS; i++) {
+		if (loop->timers[i].head && loop->timers[i].head->deadline < next)
+			next = loop->timers[i].head->deadline;
+	}
+	return next;
+}
+
+/*
+ * Frees a connection, once no io_uring request refers to it any more.
+ */
+static void ev_release(struct ev_conn *conn)
+{
+	struct ev_buf *it, *tmp;
+
+	for (it = conn->wq_head; it; it = tmp) {
+		tmp = it->next;
+		free(it);
+	}
+
+	close(conn->sock);
+	free(conn);
+}
+
+/*
+ * Closes a connection.  With the io_uring backend, outstanding requests are
+ * cancelled and the connection is freed when the last of them completes.
+ */
+static void ev_close(struct ev_conn *conn)
+{
+	struct ev_loop *loop = conn->loop;
+	struct io_uring_sqe *sqe;
+
+	if (conn->flags & EV_CONN_CLOSED)
+		return;
+	conn->flags |= EV_CONN_CLOSED;
+
+	for (int i = 0; i < EV_NR_TIMERS; i++)
+		ev_timer_stop(conn, i);
+
+	if (loop->ops->close)
+		loop->ops->close(conn);
+	loop->nr_conns--;
+#ifdef VERBOSE_LOG
+	syslog(LOG_INFO, "connection from %s closed\n", conn->paddr);
+#endif
+
+	if (loop->backend == EV_BACKEND_URING && conn->inflight) {
+		/* the ring is full: push what's queued to the kernel and retry */
+		while (!(sqe = uring_get_sqe(&loop->ring))) {
+			int rc = uring_submit(&loop->ring, 0);
+			if (rc < 0 && rc != -EINTR) {
+				/* can't cancel; shutting the socket down still
+				 * completes whatever is pending on it */
+				syslog(LOG_ERR, "io_uring_enter: %s\n",
+						strerror(-rc));
+				shutdown(conn->sock, SHUT_RDWR);
+				return;
+			}
+		}
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = conn->sock;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD
+			| IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data = ev_tag(NULL, EV_TAG_CANCEL);
+		return;
+	}
+
+	/* closing the socket also removes it from the epoll set */
+	ev_release(conn);
+}
+
+/*
+ * Runs the `timeout' callback for every timer whose deadline has passed.
+ */
+static void ev_expire(struct ev_loop *loop)
+{
+	struct ev_timer *timer;
+	struct ev_conn *conn;
+
+	for (int kind = 0; kind < EV_NR_TIMERS; kind++) {
+		while ((timer = loop->timers[kind].head)
+				&& timer->deadline <= loop->now) {
+			conn = ev_timer_conn(timer, kind);
+			ev_timer_stop(conn, kind);
+#ifdef VERBOSE_LOG
+			syslog(LOG_INFO, "connection from %s timed out\n",
+					conn->paddr);
+#endif
+			if (!loop->ops->timeout
+					|| loop->ops->timeout(conn, kind) == EV_CLOSE)
+				ev_close(conn);
+			else if (!timer->deadline && (kind != EV_TIMER_WRITE
+						|| conn->wq_head))
+				ev_timer_start(conn, kind);
+		}
+	}
+}
+
+/*
+ * Allocates and initializes a connection for a newly accepted socket.
+ * Returns NULL (after closing the socket) if the connection limit has been
+ * reached.
+ */
+static struct ev_conn *ev_conn_new(struct ev_loop *loop, int sock)
+{
+	struct ev_conn *conn;
+
+	/* close connection if connection limit reached */
+	if (loop->nr_conns >= loop->max_conns) {
+		syslog(LOG_WARNING, "connection limit reached\n");
+		close(sock);
+		return NULL;
+	}
+
+	if (!(conn = calloc(1, sizeof(struct ev_conn)))) {
+		syslog(LOG_ERR, "calloc: %s\n", strerror(errno));
+		close(sock);
+		return NULL;
+	}
+
+	conn->sock = sock;
+	conn->events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	conn->loop = loop;
+	loop->nr_conns++;
+	ev_touch_input(conn);
+	return conn;
+}
+
+/*
+ * Runs the `accept' callback for a new connection.  Returns -1 if the
+ * connection was closed.
+ */
+static int ev_conn_accept(struct ev_conn *conn)
+{
+	struct ev_loop *loop = conn->loop;
+
+#ifdef VERBOSE_LOG
+	inet_ntop(conn->addr.ss_family,
+			get_in_addr((struct sockaddr*) &conn->addr),
+			conn->paddr, sizeof conn->paddr);
+	syslog(LOG_INFO, "connection from %s\n", conn->paddr);
+#endif
+	if (loop->ops->accept && loop->ops->accept(conn) == EV_CLOSE) {
+		ev_close(conn);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Runs the `recv' callback for a chunk of input.
+ */
+static int ev_conn_recv(struct ev_conn *conn, const char *buf, size_t len)
+{
+	return conn->loop->ops->recv(conn, buf, len);
+}
+
+/*
+ * Sends as much queued output as the socket will take (epoll).  Returns 0 on
+ * success, or a negative error number.
+ */
+static int ev_epoll_flush(struct ev_conn *conn)
+{
+	struct ev_buf *buf;
+	ssize_t rc;
+	int sent = 0;
+
+	while ((buf = conn->wq_head)) {
+		rc = send(conn->sock, buf->data + buf->off, buf->len - buf->off,
+				MSG_NOSIGNAL);
+		if (rc == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		sent = 1;
+		buf->off += rc;
+		if (buf->off < buf->len)
+			break;
+
+		conn->wq_head = buf->next;
+		if (!conn->wq_head)
+			conn->wq_tail = NULL;
+		free(buf);
+	}
+
+	if (sent)
+		ev_touch_output(conn);
+	return 0;
+}
+
+/*
+ * Sets the epoll interest set for a connection: EPOLLOUT is wanted if either
+ * the user asked for it or there is queued output.  Modifying the interest set
+ * re-arms the edge trigger.
+ */
+static int ev_epoll_update(struct ev_conn *conn)
+{
+	struct epoll_event ev;
+	unsigned int events = conn->events & ~EPOLLOUT;
+
+	if ((conn->flags & EV_CONN_WANT_WRITE) || conn->wq_head)
+		events |= EPOLLOUT;
+	if (events == conn->events)
+		return 0;
+
+	conn->events = events;
+	ev.events = events;
+	ev.data.ptr = conn;
+	if (epoll_ctl(conn->loop->epfd, EPOLL_CTL_MOD, conn->sock, &ev) == -1)
+		return -errno;
+	return 0;
+}
+
+/*
+ * Accepts every pending connection on the listening socket.  Since the
+ * listening socket is edge-triggered, this must run until accept() would
+ * block.  Each connection is added to the epoll set before the `accept'
+ * callback runs, so that output it queues can change the interest set.
+ */
+static void ev_epoll_accept(struct ev_loop *loop)
+{
+	struct sockaddr_storage addr;
+	struct epoll_event ev;
+	struct ev_conn *conn;
+	socklen_t sin_size;
+	int sock;
+
+	for (;;) {
+		sin_size = sizeof(addr);
+		sock = accept4(loop->sock, (struct sockaddr*) &addr, &sin_size,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				syslog(LOG_ERR, "accept: %s\n", strerror(errno));
+			return;
+		}
+
+		if (!(conn = ev_conn_new(loop, sock)))
+			continue;
+		conn->addr = addr;
+
+		ev.events = conn->events;
+		ev.data.ptr = conn;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn->sock, &ev) == -1) {
+			/* the user never saw it, so there's no `close' call */
+			syslog(LOG_ERR, "epoll_ctl: %s\n", strerror(errno));
+			for (int i = 0; i < EV_NR_TIMERS; i++)
+				ev_timer_stop(conn, i);
+			loop->nr_conns--;
+			ev_release(conn);
+			continue;
+		}
+
+		ev_conn_accept(conn);
+	}
+}
+
+/*
+ * Reads everything available on a connection and passes it to the `recv'
+ * callback (epoll).
+ */
+static int ev_epoll_recv(struct ev_conn *conn)
+{
+	ssize_t rc;
+
+	for (;;) {
+		rc = recv(conn->sock, conn->loop->rbuf, EV_RECV_SIZE, 0);
+		if (rc == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return EV_OK;
+			if (errno == EINTR)
+				continue;
+			return EV_CLOSE;
+		}
+		if (rc == 0)
+			return EV_CLOSE;
+		if (ev_conn_recv(conn, conn->loop->rbuf, rc) == EV_CLOSE)
+			return EV_CLOSE;
+	}
+}
+
+/*
+ * Dispatches a single epoll event to the callbacks for a connection.
+ */
+static void ev_epoll_dispatch(struct ev_conn *conn, unsigned int events)
+{
+	const struct ev_ops *ops = conn->loop->ops;
+	int rc;
+
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+		ev_touch_input(conn);
+		if (ops->recv)
+			rc = ev_epoll_recv(conn);
+		else
+			rc = ops->readable ? ops->readable(conn) : EV_CLOSE;
+		if (rc == EV_CLOSE) {
+			ev_close(conn);
+			return;
+		}
+	}
+
+	if (events & EPOLLOUT) {
+		if (ev_epoll_flush(conn)) {
+			ev_close(conn);
+			return;
+		}
+		if (!conn->wq_head && (conn->flags & EV_CONN_WANT_WRITE)) {
+			if (!ops->writable || ops->writable(conn) == EV_CLOSE) {
+				ev_close(conn);
+				return;
+			}
+		}
+		if (ev_epoll_update(conn)) {
+			ev_close(conn);
+			return;
+		}
+	}
+
+	if (events & (EPOLLHUP | EPOLLERR))
+		ev_close(conn);
+}
+
+static int ev_epoll_init(struct ev_loop *loop)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+
+	if (loop->ops->recv && !(loop->rbuf = malloc(EV_RECV_SIZE)))
+		return -ENOMEM;
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd == -1)
+		return -errno;
+
+	/* the listening socket is the only entry with a NULL pointer */
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->sock, &ev) == -1) {
+		close(loop->epfd);
+		return -errno;
+	}
+	return 0;
+}
+
+static _Noreturn void ev_epoll_run(struct ev_loop *loop)
+{
+	struct epoll_event events[EV_MAX_EVENTS];
+	uint64_t next;
+	int n, timeout;
+
+	for (;;) {
+		next = ev_next_deadline(loop);
+		if (next == UINT64_MAX)
+			timeout = -1;
+		else if (next <= loop->now)
+			timeout = 0;
+		else if (next - loop->now > INT_MAX)
+			timeout = INT_MAX;
+		else
+			timeout = next - loop->now;
+
+		n = epoll_wait(loop->epfd, events, EV_MAX_EVENTS, timeout);
+		loop->now = ev_clock();
+		if (n == -1) {
+			if (errno != EINTR)
+				syslog(LOG_ERR, "epoll_wait: %s\n", strerror(errno));
+			n = 0;
+		}
+
+		for (int i = 0; i < n; i++) {
+			if (!events[i].data.ptr)
+				ev_epoll_accept(loop);
+			else
+				ev_epoll_dispatch(events[i].data.ptr,
+						events[i].events);
+		}
+
+		ev_expire(loop);
+	}
+}
+
+/*
+ * Returns a submission queue entry for a request on behalf of `conn', or NULL
+ * if the ring is full.
+ */
+static struct io_uring_sqe *ev_uring_sqe(struct ev_conn *conn, int tag,
+		void *ptr)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = uring_get_sqe(&conn->loop->ring))) {
+		syslog(LOG_ERR, "io_uring submission queue full\n");
+		return NULL;
+	}
+	sqe->fd = conn->sock;
+	sqe->user_data = ev_tag(ptr, tag);
+	conn->inflight++;
+	return sqe;
+}
+
+static int ev_uring_arm_accept(struct ev_loop *loop)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = uring_get_sqe(&loop->ring)))
+		return -EBUSY;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = loop->sock;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = ev_tag(NULL, EV_TAG_ACCEPT);
+	return 0;
+}
+
+/*
+ * Arms the input side of a connection: a receive (multishot where the kernel
+ * has it) if the user wants data, or a multishot poll if the user wants
+ * readiness.
+ */
+static int ev_uring_arm_input(struct ev_conn *conn)
+{
+	struct io_uring_sqe *sqe;
+
+	if (conn->loop->ops->recv) {
+		if (!(sqe = ev_uring_sqe(conn, EV_TAG_RECV, conn)))
+			return -1;
+		sqe->opcode = IORING_OP_RECV;
+		if (conn->loop->recv_multishot)
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = conn->loop->bufs.bgid;
+	} else {
+		if (!(sqe = ev_uring_sqe(conn, EV_TAG_POLL, conn)))
+			return -1;
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->len = IORING_POLL_ADD_MULTI;
+		sqe->poll32_events = POLLIN | POLLRDHUP;
+	}
+	return 0;
+}
+
+static int ev_uring_arm_pollout(struct ev_conn *conn)
+{
+	struct io_uring_sqe *sqe;
+
+	if (conn->flags & EV_CONN_POLLOUT)
+		return 0;
+	if (!(sqe = ev_uring_sqe(conn, EV_TAG_POLLOUT, conn)))
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->poll32_events = POLLOUT;
+	conn->flags |= EV_CONN_POLLOUT;
+	return 0;
+}
+
+/*
+ * Submits every queued but unsent chunk of output for a connection as one
+ * chain of linked sends, so that they complete in order.  MSG_WAITALL makes a
+ * short send an error, which breaks the chain.
+ */
+static void ev_uring_submit_sends(struct ev_conn *conn)
+{
+	struct io_uring_sqe *sqe, *last = NULL;
+	struct ev_buf *buf;
+
+	for (buf = conn->wq_head; buf; buf = buf->next) {
+		if (buf->submitted)
+			continue;
+		if (!(sqe = ev_uring_sqe(conn, EV_TAG_SEND, buf)))
+			break;
+		sqe->opcode = IORING_OP_SEND;
+		sqe->addr = (uintptr_t) buf->data;
+		sqe->len = buf->len;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		sqe->flags = IOSQE_IO_LINK;
+		buf->submitted = 1;
+		conn->sending++;
+		last = sqe;
+	}
+	if (last)
+		last->flags &= ~IOSQE_IO_LINK;
+}
+
+/*
+ * Submits output for every connection on the send list.  Sends for a
+ * connection are only submitted when none are in flight, so that a chain is
+ * never overtaken by a later one.
+ */
+static void ev_uring_flush_sends(struct ev_loop *loop)
+{
+	struct ev_conn *conn;
+
+	while ((conn = loop->send_list)) {
+		loop->send_list = conn->send_next;
+		conn->flags &= ~EV_CONN_SENDQ;
+		if (!(conn->flags & EV_CONN_CLOSED) && !conn->sending)
+			ev_uring_submit_sends(conn);
+	}
+}
+
+static void ev_uring_queue_sends(struct ev_conn *conn)
+{
+	if (conn->flags & EV_CONN_SENDQ)
+		return;
+	conn->flags |= EV_CONN_SENDQ;
+	conn->send_next = conn->loop->send_list;
+	conn->loop->send_list = conn;
+}
+
+/*
+ * Makes sure a timeout request will wake the loop by the earliest timer
+ * deadline.  Only one is kept in flight; if an earlier deadline turns up, the
+ * pending request is moved.  A request that fires early is harmless.
+ */
+static void ev_uring_arm_timer(struct ev_loop *loop)
+{
+	struct io_uring_sqe *sqe;
+	uint64_t next = ev_next_deadline(loop);
+
+	if (next >= loop->timer_deadline)
+		return;
+	if (!(sqe = uring_get_sqe(&loop->ring)))
+		return;
+
+	loop->timer_ts.tv_sec = next / 1000;
+	loop->timer_ts.tv_nsec = (next % 1000) * 1000000;
+
+	if (loop->timer_deadline == UINT64_MAX) {
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (uintptr_t) &loop->timer_ts;
+		sqe->len = 1;
+		sqe->timeout_flags = IORING_TIMEOUT_ABS;
+		sqe->user_data = ev_tag(NULL, EV_TAG_TIMER);
+	} else {
+		sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = ev_tag(NULL, EV_TAG_TIMER);
+		sqe->addr2 = (uintptr_t) &loop->timer_ts;
+		sqe->timeout_flags = IORING_TIMEOUT_UPDATE | IORING_TIMEOUT_ABS;
+		sqe->user_data = ev_tag(NULL, EV_TAG_CANCEL);
+	}
+	loop->timer_deadline = next;
+}
+
+static void ev_uring_accept(struct ev_loop *loop, int res, unsigned int flags)
+{
+	struct ev_conn *conn;
+	socklen_t sin_size;
+
+	if (!(flags & IORING_CQE_F_MORE) && ev_uring_arm_accept(loop))
+		syslog(LOG_ERR, "failed to re-arm accept\n");
+
+	if (res < 0) {
+		if (res != -EINTR && res != -ECONNABORTED)
+			syslog(LOG_ERR, "accept: %s\n", strerror(-res));
+		return;
+	}
+
+	if (!(conn = ev_conn_new(loop, res)))
+		return;
+
+	sin_size = sizeof(conn->addr);
+	getpeername(conn->sock, (struct sockaddr*) &conn->addr, &sin_size);
+
+	if (ev_conn_accept(conn))
+		return;
+
+	if (ev_uring_arm_input(conn)
+			|| ((conn->flags & EV_CONN_WANT_WRITE)
+				&& ev_uring_arm_pollout(conn)))
+		ev_close(conn);
+}
+
+/*
+ * Removes a chunk from a connection's output queue.  Completed sends are
+ * normally at the head, but cancelled ones may complete out of order.
+ */
+static void ev_buf_unlink(struct ev_conn *conn, struct ev_buf *buf)
+{
+	struct ev_buf **it, *prev = NULL;
+
+	for (it = &conn->wq_head; *it != buf; it = &(*it)->next)
+		prev = *it;
+
+	*it = buf->next;
+	if (conn->wq_tail == buf)
+		conn->wq_tail = prev;
+}
+
+/*
+ * Handles the completion of a request on behalf of a connection.
+ */
+static void ev_uring_complete(struct ev_conn *conn, int tag, int res,
+		unsigned int flags, struct ev_buf *buf)
+{
+	struct ev_loop *loop = conn->loop;
+	const struct ev_ops *ops = loop->ops;
+	int more = flags & IORING_CQE_F_MORE;
+	int rc = EV_OK;
+
+	if (!more)
+		conn->inflight--;
+
+	switch (tag) {
+	case EV_TAG_RECV:
+		if (flags & IORING_CQE_F_BUFFER) {
+			unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+			if (!(conn->flags & EV_CONN_CLOSED) && res > 0) {
+				ev_touch_input(conn);
+				rc = ev_conn_recv(conn,
+						uring_buf(&loop->bufs, bid), res);
+			}
+			uring_bufs_put(&loop->bufs, bid);
+		}
+		/* out of buffers: just re-arm */
+		if (res == 0 || (res < 0 && res != -ENOBUFS))
+			rc = EV_CLOSE;
+		break;
+	case EV_TAG_POLL:
+		if (conn->flags & EV_CONN_CLOSED)
+			break;
+		ev_touch_input(conn);
+		if (res < 0 || (res & (POLLIN | POLLRDHUP | POLLHUP | POLLERR)))
+			rc = ops->readable ? ops->readable(conn) : EV_CLOSE;
+		if (rc != EV_CLOSE && (res < 0 || (res & (POLLHUP | POLLERR))))
+			rc = EV_CLOSE;
+		break;
+	case EV_TAG_POLLOUT:
+		conn->flags &= ~EV_CONN_POLLOUT;
+		if (conn->flags & EV_CONN_CLOSED)
+			break;
+		if (conn->flags & EV_CONN_WANT_WRITE) {
+			rc = ops->writable ? ops->writable(conn) : EV_CLOSE;
+			if (rc != EV_CLOSE && (conn->flags & EV_CONN_WANT_WRITE)
+					&& ev_uring_arm_pollout(conn))
+				rc = EV_CLOSE;
+		}
+		break;
+	case EV_TAG_SEND:
+		conn->sending--;
+		ev_buf_unlink(conn, buf);
+		if (res < 0 || (size_t) res < buf->len) {
+			rc = EV_CLOSE;
+		} else if (!(conn->flags & EV_CONN_CLOSED)) {
+			ev_touch_output(conn);
+			if (!conn->sending && conn->wq_head)
+				ev_uring_queue_sends(conn);
+		}
+		free(buf);
+		break;
+	}
+
+	if (conn->flags & EV_CONN_CLOSED) {
+		if (!conn->inflight)
+			ev_release(conn);
+		return;
+	}
+
+	if (rc == EV_CLOSE) {
+		ev_close(conn);
+		return;
+	}
+
+	if (!more && (tag == EV_TAG_RECV || tag == EV_TAG_POLL)
+			&& ev_uring_arm_input(conn))
+		ev_close(conn);
+}
+
+/*
+ * Finds out whether the kernel supports multishot receive (Linux 6.0), which
+ * arrived after provided buffer rings and multishot accept (5.19), by
+ * receiving a byte over a socket pair.  An older kernel fails the request with
+ * -EINVAL.  Returns 1 if it is supported, 0 if not, or a negative error
+ * number.
+ */
+static int ev_uring_probe_recv(struct ev_loop *loop)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int sv[2], rc = 0, multishot = 0, done = 0;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+		return -errno;
+	if (write(sv[1], "", 1) != 1) {
+		rc = -errno;
+		goto out;
+	}
+	if (!(sqe = uring_get_sqe(&loop->ring))) {
+		rc = -EBUSY;
+		goto out;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sv[0];
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = loop->bufs.bgid;
+	sqe->user_data = ev_tag(NULL, EV_TAG_CANCEL);
+
+	/* a multishot receive keeps going until the peer shuts down */
+	while (!done) {
+		rc = uring_submit(&loop->ring, 1);
+		if (rc < 0 && rc != -EINTR)
+			goto out;
+		while ((cqe = uring_peek_cqe(&loop->ring))) {
+			if (cqe->flags & IORING_CQE_F_BUFFER)
+				uring_bufs_put(&loop->bufs,
+						cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			if (cqe->flags & IORING_CQE_F_MORE) {
+				multishot = 1;
+				shutdown(sv[1], SHUT_WR);
+			} else {
+				done = 1;
+			}
+			uring_cqe_seen(&loop->ring);
+		}
+	}
+	rc = multishot;
+out:
+	close(sv[0]);
+	close(sv[1]);
+	return rc;
+}
+
+static int ev_uring_init(struct ev_loop *loop)
+{
+	int rc;
+
+	if ((rc = uring_init(&loop->ring, EV_URING_ENTRIES)))
+		return rc;
+
+	/* provided buffer rings arrived together with multishot accept */
+	rc = uring_bufs_init(&loop->ring, &loop->bufs, 0, EV_URING_BUFS,
+			EV_URING_BUFSIZE);
+	if (rc) {
+		uring_destroy(&loop->ring);
+		return rc;
+	}
+
+	/* without multishot receive, a receive is re-armed after each one */
+	loop->recv_multishot = 0;
+	if (loop->ops->recv) {
+		if ((rc = ev_uring_probe_recv(loop)) < 0)
+			goto err;
+		loop->recv_multishot = rc;
+		if (!rc)
+			syslog(LOG_INFO, "no multishot recv, using single-shot\n");
+	}
+
+	loop->send_list = NULL;
+	loop->timer_deadline = UINT64_MAX;
+	if (!(rc = ev_uring_arm_accept(loop)))
+		return 0;
+err:
+	uring_bufs_destroy(&loop->ring, &loop->bufs);
+	uring_destroy(&loop->ring);
+	return rc;
+}
+
+static _Noreturn void ev_uring_run(struct ev_loop *loop)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int flags;
+	uint64_t data;
+	void *ptr;
+	int rc, res;
+
+	for (;;) {
+		ev_uring_flush_sends(loop);
+		ev_uring_arm_timer(loop);
+
+		rc = uring_submit(&loop->ring, 1);
+		if (rc < 0 && rc != -EINTR && rc != -EBUSY)
+			syslog(LOG_ERR, "io_uring_enter: %s\n", strerror(-rc));
+		loop->now = ev_clock();
+
+		while ((cqe = uring_peek_cqe(&loop->ring))) {
+			data = cqe->user_data;
+			res = cqe->res;
+			flags = cqe->flags;
+			uring_cqe_seen(&loop->ring);
+
+			ptr = (void*) (uintptr_t) (data & ~(uint64_t) EV_TAG_MASK);
+			switch (data & EV_TAG_MASK) {
+			case EV_TAG_ACCEPT:
+				ev_uring_accept(loop, res, flags);
+				break;
+			case EV_TAG_CANCEL:
+				break;
+			case EV_TAG_TIMER:
+				loop->timer_deadline = UINT64_MAX;
+				break;
+			case EV_TAG_SEND:
+				ev_uring_complete(((struct ev_buf*) ptr)->conn,
+						EV_TAG_SEND, res, flags, ptr);
+				break;
+			default:
+				ev_uring_complete(ptr, data & EV_TAG_MASK, res,
+						flags, NULL);
+				break;
+			}
+		}
+
+		ev_expire(loop);
+	}
+}
+
+/*
+ * Prepares an event loop to serve connections arriving on the listening
+ * socket `sock'.  With EV_BACKEND_AUTO the io_uring backend is used if the
+ * kernel supports everything it needs, and epoll otherwise.  Returns 0 on
+ * success, or a negative error number.
+ */
+int ev_loop_init(struct ev_loop *loop, int sock, int max_conns,
+		const struct ev_ops *ops, int backend)
+{
+	int flags, rc;
+
+	flags = fcntl(sock, F_GETFL);
+	if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1)
+		return -errno;
+
+	loop->sock = sock;
+	loop->max_conns = max_conns;
+	loop->nr_conns = 0;
+	loop->ops = ops;
+	loop->rbuf = NULL;
+	loop->now = ev_clock();
+	memset(loop->timeout, 0, sizeof(loop->timeout));
+	memset(loop->timers, 0, sizeof(loop->timers));
+
+	if (backend != EV_BACKEND_EPOLL) {
+		rc = ev_uring_init(loop);
+		if (!rc) {
+			loop->backend = EV_BACKEND_URING;
+			return 0;
+		}
+		if (backend == EV_BACKEND_URING)
+			return rc;
+		syslog(LOG_INFO, "io_uring unavailable (%s), using epoll\n",
+				strerror(-rc));
+	}
+
+	loop->backend = EV_BACKEND_EPOLL;
+	return ev_epoll_init(loop);
+}
+
+/*
+ * Sets the interval of one kind of connection timer (EV_TIMER_*), or disables
+ * it if `ms' is 0.  Timers are disabled by default.  This must be called
+ * before ev_loop_run().  Returns 0 on success, or a negative error number.
+ */
+int ev_set_timeout(struct ev_loop *loop, int timer, unsigned int ms)
+{
+	if (timer < 0 || timer >= EV_NR_TIMERS)
+		return -EINVAL;
+	loop->timeout[timer] = ms;
+	return 0;
+}
+
+_Noreturn void ev_loop_run(struct ev_loop *loop)
+{
+	if (loop->backend == EV_BACKEND_URING)
+		ev_uring_run(loop);
+	ev_epoll_run(loop);
+}
+
+/*
+ * Enables or disables the `writable' callback for a connection.  If the
+ * socket is already writable the callback fires on the next iteration of the
+ * loop.
+ */
+int ev_want_write(struct ev_conn *conn, int on)
+{
+	if (on)
+		conn->flags |= EV_CONN_WANT_WRITE;
+	else
+		conn->flags &= ~EV_CONN_WANT_WRITE;
+
+	if (conn->loop->backend == EV_BACKEND_URING) {
+		if (on && ev_uring_arm_pollout(conn))
+			return -EBUSY;
+		return 0;
+	}
+	return ev_epoll_update(conn);
+}
+
+/*
+ * Queues `len' bytes of output on a connection.  The data is copied, so `buf'
+ * may be reused immediately.  Output is sent in order, after any output
+ * queued earlier.  Returns 0 on success, or a negative error number, in which
+ * case the caller should close the connection.
+ */
+int ev_send(struct ev_conn *conn, const char *buf, size_t len)
+{
+	struct ev_buf *out;
+	ssize_t rc = 0;
+
+	/* try to send directly if nothing is queued (epoll) */
+	if (conn->loop->backend == EV_BACKEND_EPOLL && !conn->wq_head) {
+		while ((rc = send(conn->sock, buf, len, MSG_NOSIGNAL)) == -1
+				&& errno == EINTR)
+			;
+		if (rc == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -errno;
+			rc = 0;
+		}
+		if (rc > 0)
+			ev_timer_start(conn, EV_TIMER_IDLE);
+		if ((size_t) rc == len)
+			return 0;
+	}
+
+	if (!(out = malloc(sizeof(struct ev_buf) + len - rc)))
+		return -ENOMEM;
+	memcpy(out->data, buf + rc, len - rc);
+	out->next = NULL;
+	out->conn = conn;
+	out->len = len - rc;
+	out->off = 0;
+	out->submitted = 0;
+
+	if (conn->wq_tail)
+		conn->wq_tail->next = out;
+	else
+		conn->wq_head = out;
+	conn->wq_tail = out;
+
+	/* the write timer measures lack of progress, not time since queueing */
+	if (rc > 0 || !conn->timers[EV_TIMER_WRITE].deadline)
+		ev_timer_start(conn, EV_TIMER_WRITE);
+
+	if (conn->loop->backend == EV_BACKEND_URING) {
+		ev_uring_queue_sends(conn);
+		return 0;
+	}
+	return ev_epoll_update(conn);
+}
+
+_Noreturn void tcp_event_main(int sock, int max_conns,
+		const struct ev_ops *ops, int backend)
+{
+	struct ev_loop loop;
+	int rc;
+
+	if ((rc = ev_loop_init(&loop, sock, max_conns, ops, backend))) {
+		syslog(LOG_EMERG, "ev_loop_init: %s\n", strerror(-rc));
+		exit(EXIT_FAILURE);
+	}
+
+	ev_loop_run(&loop);
+}
@@ -0,0 +1,138 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _EVSERVER_H
+#define _EVSERVER_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "uring.h"
+
+/* I/O backends for an event loop */
+enum {
+	EV_BACKEND_AUTO,           // io_uring if supported, otherwise epoll
+	EV_BACKEND_EPOLL,
+	EV_BACKEND_URING
+};
+
+/* return values for the ev_ops callbacks */
+enum {
+	EV_OK    =  0,
+	EV_CLOSE = -1
+};
+
+/* connection timers */
+enum {
+	EV_TIMER_IDLE,             // no input or output
+	EV_TIMER_READ,             // no input
+	EV_TIMER_WRITE,            // queued output not draining
+	EV_NR_TIMERS
+};
+
+struct ev_loop;
+struct ev_buf;
+
+struct ev_timer {
+	struct ev_timer *prev;
+	struct ev_timer *next;
+	uint64_t deadline;         // ms on the loop clock; 0 if not armed
+};
+
+struct ev_timer_list {
+	struct ev_timer *head;     // earliest deadline
+	struct ev_timer *tail;
+};
+
+/*
+ * A TCP connection owned by an event loop.  `data' is for the user; the loop
+ * never touches it.
+ */
+struct ev_conn {
+	int sock;
+	unsigned int events;       // current epoll interest set
+	unsigned int flags;
+	unsigned int inflight;     // io_uring requests referring to the conn
+	unsigned int sending;      // sends submitted but not completed
+	void *data;
+	struct ev_loop *loop;
+	struct ev_buf *wq_head;    // output queued by ev_send()
+	struct ev_buf *wq_tail;
+	struct ev_conn *send_next; // next conn with output to submit
+	struct ev_timer timers[EV_NR_TIMERS];
+	struct sockaddr_storage addr;
+	char paddr[INET6_ADDRSTRLEN];
+};
+
+/*
+ * Callbacks invoked by the event loop.  Sockets are non-blocking and
+ * edge-triggered, so `readable' and `writable' must consume input (or output
+ * space) until the socket returns EAGAIN; otherwise no further event will be
+ * delivered for that direction.  Returning EV_CLOSE from any callback closes
+ * the connection.  `accept' and `close' may be NULL.  Without `readable' (and
+ * `recv'), or without `writable' while ev_want_write() is on, the connection
+ * is closed when the event arrives.
+ *
+ * If `recv' is set, the loop reads from the socket itself and passes the
+ * data to `recv' instead of calling `readable'.  The buffer belongs to the
+ * loop and is only valid for the duration of the call.  With the io_uring
+ * backend this uses multishot receives into a ring of provided buffers.
+ *
+ * `timeout' is called when one of the connection's timers (EV_TIMER_*)
+ * expires.  Returning EV_OK restarts the timer; if `timeout' is NULL the
+ * connection is closed.
+ */
+struct ev_ops {
+	int (*accept)(struct ev_conn *conn);
+	int (*readable)(struct ev_conn *conn);
+	int (*recv)(struct ev_conn *conn, const char *buf, size_t len);
+	int (*writable)(struct ev_conn *conn);
+	void (*close)(struct ev_conn *conn);
+	int (*timeout)(struct ev_conn *conn, int timer);
+};
+
+struct ev_loop {
+	int backend;
+	int epfd;
+	int sock;                  // listening socket
+	int max_conns;
+	int nr_conns;
+	const struct ev_ops *ops;
+	char *rbuf;                // receive buffer for `recv' (epoll)
+	struct ev_conn *send_list; // conns with output to submit (io_uring)
+	struct uring ring;
+	struct uring_bufs bufs;
+	int recv_multishot;        // kernel has multishot recv (io_uring)
+	uint64_t now;              // loop clock (ms), updated once per wakeup
+	unsigned int timeout[EV_NR_TIMERS];
+	struct ev_timer_list timers[EV_NR_TIMERS];
+	uint64_t timer_deadline;   // expiry of the armed timeout (io_uring)
+	struct __kernel_timespec timer_ts;
+};
+
+int ev_loop_init(struct ev_loop *loop, int sock, int max_conns,
+		const struct ev_ops *ops, int backend);
+int ev_set_timeout(struct ev_loop *loop, int timer, unsigned int ms);
+_Noreturn void ev_loop_run(struct ev_loop *loop);
+
+int ev_want_write(struct ev_conn *conn, int on);
+int ev_send(struct ev_conn *conn, const char *buf, size_t len);
+
+_Noreturn void tcp_event_main(int sock, int max_conns,
+		const struct ev_ops *ops, int backend);
+
+#endif
@@ -0,0 +1,643 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* fuzz.c
+ *
+ * A fuzzer for the framing functions in network.c.  Each iteration builds a
+ * stream of frames, corrupts it half of the time, and feeds it through a
+ * socketpair from another thread in chunks of random size.  The readers must
+ * return exactly the frames of an intact stream; on a corrupted one they must
+ * agree with each other, and with the in-buffer parsers (varint_parse() and
+ * netscan.c's netstring_scan()), on the frames before the damage.  Build with
+ * -fsanitize=address to catch what they do after it:
+ *
+ *   cc -fsanitize=address fuzz.c network.c netscan.c msgbuf.c metrics.c \
+ *       -lpthread
+ *   ./a.out [iterations [seed]]
+ *
+ * Iteration `i' uses seed `seed + i', so a failure can be replayed alone.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#include "network.h"
+#include "netscan.h"
+
+#define FUZZ_MAX_FRAMES 16
+#define FUZZ_MAX_STREAM (2 * 1024 * 1024)
+
+/* prefixes every reader must reject without trusting */
+static const char *const fuzz_prefixes[] = {
+	"99999999999999999999999999:", "18446744073709551616:",
+	"16777217:", "05:hello,", "00:,", "0:,", "0", ":", "-1:", "1a:",
+	"1:x;",
+	"\xc0\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01",
+	"\xc1\x01\xff\xff\xff\xff\xff\x0f", "\xc0\x80\x80\x80\x80\x80\x08",
+	"\xc0",
+};
+
+struct fuzz_stream {
+	char *buf;
+	size_t len;
+	size_t nr_frames;
+	size_t start[FUZZ_MAX_FRAMES];  // frame offsets in `buf'
+	size_t off[FUZZ_MAX_FRAMES];    // payload offsets in `buf'
+	size_t size[FUZZ_MAX_FRAMES];
+	int tag[FUZZ_MAX_FRAMES];
+};
+
+struct fuzz_frame {
+	char *data;
+	size_t len;
+	int tag;
+};
+
+struct feeder {
+	pthread_t tid;
+	int sock;
+	const char *buf;
+	size_t len;
+	size_t max_chunk;
+	uint64_t seed;
+};
+
+static uint64_t fuzz_seed;
+
+static uint64_t xorshift(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static _Noreturn void fuzz_fail(const char *what, size_t frame)
+{
+	fprintf(stderr, "%s differs at frame %zu (replay: 1 %lu)\n", what,
+			frame, (unsigned long) fuzz_seed);
+	abort();
+}
+
+static void make_socketpair(int sv[2])
+{
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		perror("socketpair");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Writes a stream in chunks of 1 to `max_chunk' bytes, yielding between
+ * them so that the reader sees the stream a piece at a time.  Stops early if
+ * the reader goes away.
+ */
+static void *feeder_main(void *data)
+{
+	struct feeder *f = data;
+	size_t off = 0, n;
+
+	while (off < f->len) {
+		n = xorshift(&f->seed) % f->max_chunk + 1;
+		if (n > f->len - off)
+			n = f->len - off;
+		if (tcp_send_bytes(f->sock, f->buf + off, n) < 0)
+			break;
+		off += n;
+		if (!(xorshift(&f->seed) & 3))
+			sched_yield();
+	}
+	shutdown(f->sock, SHUT_WR);
+	return NULL;
+}
+
+/*
+ * Starts feeding `s' into a new socketpair and returns the reading end.
+ */
+static int feed(struct feeder *f, const struct fuzz_stream *s, uint64_t *rng)
+{
+	static const size_t chunks[] = { 1, 2, 3, 7, 64, 4096, 65536 };
+	int sv[2];
+
+	make_socketpair(sv);
+	f->sock = sv[1];
+	f->buf = s->buf;
+	f->len = s->len;
+	f->max_chunk = chunks[xorshift(rng) % (sizeof(chunks)/sizeof(*chunks))];
+	/* byte-sized chunks of a large stream take too long to be worth it */
+	if (s->len > 16384 && f->max_chunk < 64)
+		f->max_chunk = 64;
+	f->seed = xorshift(rng) | 1;
+	if (pthread_create(&f->tid, NULL, feeder_main, f)) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+	return sv[0];
+}
+
+/*
+ * Closes the reading end (so a feeder blocked on a full socket fails) and
+ * waits for the feeder.
+ */
+static void unfeed(struct feeder *f, int sock)
+{
+	close(sock);
+	pthread_join(f->tid, NULL);
+	close(f->sock);
+}
+
+/*
+ * Encodes `v' as a LEB128 varint, as network.c does.  Returns the number of
+ * bytes used.
+ */
+static size_t varint_encode(unsigned char *p, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+static size_t fuzz_payload_len(uint64_t *rng)
+{
+	switch (xorshift(rng) % 8) {
+	case 0:  return xorshift(rng) % 70000 + 1;   // grows reader buffers
+	case 1:  return xorshift(rng) % 10 + 1;
+	default: return xorshift(rng) % 300 + 1;
+	}
+}
+
+/*
+ * Appends a frame with a random payload.  Payloads are never empty, since an
+ * empty frame ends the stream.  With `format' -1, the format is random.
+ */
+static void fuzz_append(struct fuzz_stream *s, int format, uint64_t *rng)
+{
+	unsigned char *p = (unsigned char*) s->buf + s->len;
+	size_t size = fuzz_payload_len(rng), hdr = 0;
+	int tag = VARINT_NO_TAG;
+
+	if (format < 0)
+		format = xorshift(rng) & 1;
+
+	if (format == 0) {
+		hdr = sprintf((char*) p, "%zu:", size);
+	} else {
+		p[hdr++] = VARINT_MARKER;
+		hdr += varint_encode(p + hdr, size);
+		if (xorshift(rng) & 1) {
+			p[0] |= VARINT_TAGGED;
+			tag = xorshift(rng) % (1u << (xorshift(rng) % 31));
+			hdr += varint_encode(p + hdr, tag);
+		}
+	}
+
+	for (size_t i = 0; i < size; i++)
+		p[hdr + i] = xorshift(rng);
+	s->start[s->nr_frames] = s->len;
+	s->off[s->nr_frames] = s->len + hdr;
+	s->size[s->nr_frames] = size;
+	s->tag[s->nr_frames] = tag;
+	s->nr_frames++;
+	s->len += hdr + size;
+	if (format == 0)
+		s->buf[s->len++] = ',';
+}
+
+/*
+ * Damages a stream: flips, truncates, or splices in a hostile prefix (half of
+ * the time where a frame starts).
+ */
+static void fuzz_mutate(struct fuzz_stream *s, uint64_t *rng)
+{
+	const char *pre;
+	size_t at, n;
+
+	switch (xorshift(rng) % 3) {
+	case 0:
+		for (n = xorshift(rng) % 4 + 1; n && s->len; n--)
+			s->buf[xorshift(rng) % s->len] ^= 1 << (xorshift(rng) & 7);
+		break;
+	case 1:
+		s->len = s->len ? xorshift(rng) % s->len : 0;
+		break;
+	case 2:
+		pre = fuzz_prefixes[xorshift(rng) % (sizeof(fuzz_prefixes)
+					/ sizeof(*fuzz_prefixes))];
+		n = strlen(pre);
+		if (xorshift(rng) & 1)
+			at = s->start[xorshift(rng) % s->nr_frames];
+		else
+			at = s->len ? xorshift(rng) % s->len : 0;
+		memmove(s->buf + at + n, s->buf + at, s->len - at);
+		memcpy(s->buf + at, pre, n);
+		s->len += n;
+		break;
+	}
+}
+
+/*
+ * Collects frames from `rd' until it returns 0 or an error.  Returns the
+ * number of frames.
+ */
+static size_t fuzz_collect(ssize_t (*rd)(void*, struct fuzz_frame*),
+		void *arg, struct fuzz_frame *frames)
+{
+	size_t n = 0;
+
+	while (n < FUZZ_MAX_FRAMES + 1 && rd(arg, &frames[n]) > 0)
+		n++;
+	return n;
+}
+
+static void fuzz_free(struct fuzz_frame *frames, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		free(frames[i].data);
+}
+
+static void fuzz_compare(const char *what, const struct fuzz_frame *a,
+		size_t na, const struct fuzz_frame *b, size_t nb)
+{
+	for (size_t i = 0; i < na || i < nb; i++) {
+		if (i == na || i == nb || a[i].len != b[i].len
+				|| a[i].tag != b[i].tag
+				|| memcmp(a[i].data, b[i].data, a[i].len))
+			fuzz_fail(what, i);
+	}
+}
+
+/* the frames of a stream, as written */
+static size_t fuzz_expected(const struct fuzz_stream *s,
+		struct fuzz_frame *frames, int tags)
+{
+	for (size_t i = 0; i < s->nr_frames; i++) {
+		frames[i].data = s->buf + s->off[i];
+		frames[i].len = s->size[i];
+		frames[i].tag = tags ? s->tag[i] : VARINT_NO_TAG;
+	}
+	return s->nr_frames;
+}
+
+static ssize_t rd_done(struct fuzz_frame *f, ssize_t rv)
+{
+	f->len = rv > 0 ? rv : 0;
+	return rv;
+}
+
+static ssize_t rd_netstring(void *sock, struct fuzz_frame *f)
+{
+	f->tag = VARINT_NO_TAG;
+	return rd_done(f, netstring_read(*(int*) sock, &f->data));
+}
+
+static ssize_t rd_frame(void *sock, struct fuzz_frame *f)
+{
+	f->tag = VARINT_NO_TAG;
+	return rd_done(f, frame_read(*(int*) sock, &f->data));
+}
+
+static ssize_t rd_varint(void *sock, struct fuzz_frame *f)
+{
+	return rd_done(f, varint_read_tagged(*(int*) sock, &f->data, &f->tag));
+}
+
+static ssize_t rd_reader(void *r, struct fuzz_frame *f)
+{
+	f->tag = VARINT_NO_TAG;
+	return rd_done(f, netstring_reader_read(r, &f->data));
+}
+
+/* copies views, so that every reader's frames can be freed alike */
+static ssize_t rd_view(void *r, struct fuzz_frame *f)
+{
+	struct netstring_view v;
+	ssize_t rv;
+
+	if ((rv = netstring_reader_view(r, &v)) <= 0)
+		return rv;
+	f->data = malloc(v.len + 1);
+	memcpy(f->data, v.data, v.len + 1);
+	f->len = v.len;
+	f->tag = VARINT_NO_TAG;
+	return rv;
+}
+
+struct batch_state {
+	struct netstring_reader r;
+	struct netstring_view views[FUZZ_MAX_FRAMES];
+	size_t max, nr, next;
+	uint64_t rng;
+};
+
+static ssize_t rd_batch(void *data, struct fuzz_frame *f)
+{
+	struct batch_state *b = data;
+	ssize_t rv;
+
+	if (b->next == b->nr) {
+		rv = netstring_reader_batch(&b->r, b->views,
+				xorshift(&b->rng) % b->max + 1);
+		if (rv <= 0)
+			return rv;
+		b->nr = rv;
+		b->next = 0;
+	}
+	f->len = b->views[b->next].len;
+	f->data = malloc(f->len + 1);
+	memcpy(f->data, b->views[b->next].data, f->len + 1);
+	f->tag = VARINT_NO_TAG;
+	b->next++;
+	return f->len;
+}
+
+/*
+ * The netstrings of a buffer, by netstring_scan() in batches of random size,
+ * up to the first that is malformed, truncated or (like an end of stream to
+ * netstring_read()) empty.
+ */
+static size_t scan_reference(const struct fuzz_stream *s,
+		struct fuzz_frame *frames, uint64_t *rng)
+{
+	struct netstring_frame nf[FUZZ_MAX_FRAMES + 1];
+	size_t off = 0, n = 0, used;
+	ssize_t rv;
+
+	while (n < FUZZ_MAX_FRAMES + 1) {
+		rv = netstring_scan(s->buf + off, s->len - off, nf,
+				xorshift(rng) % (FUZZ_MAX_FRAMES + 1 - n) + 1,
+				&used);
+		if (rv <= 0)
+			break;
+		for (ssize_t i = 0; i < rv; i++) {
+			if (!nf[i].len)
+				return n;
+			frames[n].data = s->buf + off + nf[i].off;
+			frames[n].len = nf[i].len;
+			frames[n].tag = VARINT_NO_TAG;
+			n++;
+		}
+		off += used;
+	}
+	return n;
+}
+
+/*
+ * The varint frames of a buffer, by varint_parse(), up to the first that is
+ * malformed, truncated or (like an end of stream to varint_read()) empty.
+ */
+static size_t varint_reference(const struct fuzz_stream *s,
+		struct fuzz_frame *frames)
+{
+	size_t off = 0, n = 0, hdr, size;
+	int tag;
+
+	while (n < FUZZ_MAX_FRAMES + 1 && off < s->len) {
+		if (varint_parse(s->buf + off, s->len - off, &hdr, &size,
+					&tag) <= 0)
+			break;
+		if (!size || s->len - off - hdr < size)
+			break;
+		frames[n].data = s->buf + off + hdr;
+		frames[n].len = size;
+		frames[n].tag = tag;
+		n++;
+		off += hdr + size;
+	}
+	return n;
+}
+
+/*
+ * Runs one reader over a fed stream and returns its frames.
+ */
+static size_t fuzz_run(const struct fuzz_stream *s, int reader,
+		struct fuzz_frame *frames, uint64_t *rng)
+{
+	struct feeder f;
+	struct batch_state b;
+	struct netstring_reader r;
+	int sock = feed(&f, s, rng);
+	size_t n;
+
+	switch (reader) {
+	case 0:
+		n = fuzz_collect(rd_netstring, &sock, frames);
+		break;
+	case 1:
+	case 2:
+		netstring_reader_init(&r, sock, xorshift(rng) % 256 + 1);
+		n = fuzz_collect(reader == 1 ? rd_reader : rd_view, &r,
+				frames);
+		netstring_reader_destroy(&r);
+		break;
+	case 3:
+		netstring_reader_init(&b.r, sock, xorshift(rng) % 256 + 1);
+		b.max = FUZZ_MAX_FRAMES;
+		b.nr = b.next = 0;
+		b.rng = xorshift(rng) | 1;
+		n = fuzz_collect(rd_batch, &b, frames);
+		netstring_reader_destroy(&b.r);
+		break;
+	case 4:
+		n = fuzz_collect(rd_varint, &sock, frames);
+		break;
+	default:
+		n = fuzz_collect(rd_frame, &sock, frames);
+		break;
+	}
+	unfeed(&f, sock);
+	return n;
+}
+
+/*
+ * Sends random bytes with tcp_send_nb() or tcp_send_vector() through a
+ * random split of iovecs, and receives them with tcp_recv_nb() through
+ * another.
+ */
+struct nb_sender {
+	pthread_t tid;
+	int sock;
+	const char *buf;
+	size_t len;
+	int blocking;
+	uint64_t seed;
+};
+
+static size_t split_iov(struct iovec *vec, size_t max, char *buf, size_t len,
+		uint64_t *rng)
+{
+	size_t n = 0, off = 0, chunk;
+
+	while (off < len && n < max) {
+		chunk = n == max - 1 ? len - off : xorshift(rng) % 700;
+		if (chunk > len - off)
+			chunk = len - off;
+		vec[n].iov_base = buf + off;
+		vec[n].iov_len = chunk;
+		off += chunk;
+		n++;
+	}
+	return n;
+}
+
+static void *nb_sender_main(void *data)
+{
+	struct nb_sender *s = data;
+	struct pollfd pfd = { .fd = s->sock, .events = POLLOUT };
+	struct iovec vec[64];
+	struct tcp_io io;
+	size_t n;
+
+	n = split_iov(vec, 64, (char*) s->buf, s->len, &s->seed);
+	if (s->blocking) {
+		if (tcp_send_vector(s->sock, vec, n) != (ssize_t) s->len)
+			fuzz_fail("tcp_send_vector", 0);
+	} else {
+		tcp_io_init(&io, vec, n);
+		while (tcp_send_nb(s->sock, &io) > 0)
+			poll(&pfd, 1, -1);
+	}
+	shutdown(s->sock, SHUT_WR);
+	return NULL;
+}
+
+static void fuzz_nb(uint64_t *rng)
+{
+	size_t len = xorshift(rng) % 200000 + 1, n;
+	char *in = malloc(len), *out = malloc(len);
+	struct pollfd pfd = { .events = POLLIN };
+	struct nb_sender s;
+	struct iovec vec[64];
+	struct tcp_io io;
+	ssize_t rv;
+	int sv[2];
+
+	for (size_t i = 0; i < len; i++)
+		in[i] = xorshift(rng);
+
+	make_socketpair(sv);
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	s.sock = sv[1];
+	s.buf = in;
+	s.len = len;
+	s.blocking = xorshift(rng) & 1;
+	s.seed = xorshift(rng) | 1;
+	if (!s.blocking)
+		fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	if (pthread_create(&s.tid, NULL, nb_sender_main, &s)) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+
+	n = split_iov(vec, 64, out, len, rng);
+	tcp_io_init(&io, vec, n);
+	pfd.fd = sv[0];
+	while ((rv = tcp_recv_nb(sv[0], &io)) > 0)
+		poll(&pfd, 1, -1);
+	if (rv < 0 || memcmp(in, out, len))
+		fuzz_fail("tcp_recv_nb", 0);
+
+	pthread_join(s.tid, NULL);
+	close(sv[0]);
+	close(sv[1]);
+	free(in);
+	free(out);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *const readers[] = {
+		"netstring_read", "netstring_reader_read",
+		"netstring_reader_view", "netstring_reader_batch",
+		"varint_read", "frame_read",
+	};
+	struct fuzz_frame want[FUZZ_MAX_FRAMES + 1];
+	struct fuzz_frame got[FUZZ_MAX_FRAMES + 1];
+	struct fuzz_frame first[FUZZ_MAX_FRAMES + 1];
+	unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000;
+	uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 10) : (uint64_t) time(NULL);
+	struct fuzz_stream s;
+	size_t nw, ng, nf;
+	uint64_t rng;
+	int format, damaged;
+
+	if (!(s.buf = malloc(FUZZ_MAX_STREAM)))
+		return EXIT_FAILURE;
+	printf("seed %lu\n", (unsigned long) seed);
+
+	for (unsigned long i = 0; i < iterations; i++) {
+		fuzz_seed = seed + i;
+		rng = fuzz_seed * 0x9e3779b97f4a7c15 | 1;
+
+		/* 0: netstrings, 1: varint frames, 2: both */
+		format = xorshift(&rng) % 3;
+		s.len = s.nr_frames = 0;
+		for (size_t n = xorshift(&rng) % FUZZ_MAX_FRAMES + 1; n; n--)
+			fuzz_append(&s, format == 2 ? -1 : format, &rng);
+		if ((damaged = xorshift(&rng) & 1))
+			fuzz_mutate(&s, &rng);
+
+		if (format == 0) {
+			/* the netstring readers must agree with each other */
+			nf = fuzz_run(&s, 0, first, &rng);
+			if (!damaged) {
+				nw = fuzz_expected(&s, want, 0);
+				fuzz_compare(readers[0], want, nw, first, nf);
+			}
+			ng = scan_reference(&s, got, &rng);
+			fuzz_compare("netstring_scan", first, nf, got, ng);
+			for (int r = 1; r <= 3; r++) {
+				ng = fuzz_run(&s, r, got, &rng);
+				fuzz_compare(readers[r], first, nf, got, ng);
+				fuzz_free(got, ng);
+			}
+			fuzz_free(first, nf);
+		} else if (format == 1) {
+			nw = varint_reference(&s, want);
+			ng = fuzz_run(&s, 4, got, &rng);
+			fuzz_compare(readers[4], want, nw, got, ng);
+			fuzz_free(got, ng);
+		} else {
+			/* frame_read() drops tags; only check intact streams */
+			ng = fuzz_run(&s, 5, got, &rng);
+			if (!damaged) {
+				nw = fuzz_expected(&s, want, 0);
+				fuzz_compare(readers[5], want, nw, got, ng);
+			}
+			fuzz_free(got, ng);
+		}
+
+		fuzz_nb(&rng);
+	}
+
+	printf("%lu iterations passed\n", iterations);
+	free(s.buf);
+	return EXIT_SUCCESS;
+}
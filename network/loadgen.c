@@ -0,0 +1,514 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* loadgen.c
+ *
+ * This file implements a load generator for the servers in this directory.
+ * It drives an echo service over TCP (raw, netstring or varint framing) or UDP
+ * with a fixed number of closed-loop connections, one thread each, and reports
+ * throughput and the latency distribution.  It can also start an echo server
+ * in-process, in any of the threading modes of server.c or on either backend
+ * of the event loop in evserver.c, so that they can be compared on loopback.
+ * Each UDP request carries a sequence number, so that a late reply to a
+ * request that timed out is not taken for the reply to the next one.  Compile
+ * with -DLOADGEN_MAIN for a command-line driver:
+ *
+ *   cc -DLOADGEN_MAIN loadgen.c network.c msgbuf.c metrics.c server.c mpmc.c \
+ *       msgpool.c evserver.c uring.c -lpthread
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+
+#include "network.h"
+#include "server.h"
+#include "evserver.h"
+#include "loadgen.h"
+
+/* pool queue length and recvmmsg() batch size of the echo server */
+#define ECHO_QUEUE_LEN 1024
+#define ECHO_BATCH     64
+
+/* the in-process echo server */
+static struct {
+	int sock;
+	int socktype;
+	int framing;
+	int mode;
+	int threads;
+	struct ev_loop loop;
+} echo;
+
+struct loadgen_worker {
+	pthread_t tid;
+	const struct loadgen_config *cfg;
+	const struct addrinfo *ai;
+	uint64_t deadline;
+	uint64_t seq;              // sequence number of the last UDP request
+	unsigned long requests;
+	unsigned long errors;
+	struct histogram latency;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int loadgen_connect(struct loadgen_worker *w)
+{
+	const struct loadgen_config *cfg = w->cfg;
+	struct timeval tv = {
+		.tv_sec  = cfg->timeout_ms / 1000,
+		.tv_usec = (cfg->timeout_ms % 1000) * 1000
+	};
+	int sock;
+
+	sock = socket(w->ai->ai_family, w->ai->ai_socktype,
+			w->ai->ai_protocol);
+	if (sock == -1)
+		return -1;
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if (connect(sock, w->ai->ai_addr, w->ai->ai_addrlen) == -1) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/*
+ * Sends one UDP request, stamped with the next sequence number, and waits for
+ * its reply.  Replies to earlier requests that timed out are discarded.  With
+ * messages shorter than a sequence number only its low bytes are compared.
+ */
+static int loadgen_request_udp(struct loadgen_worker *w, int sock, char *msg,
+		char *reply)
+{
+	size_t len = w->cfg->msg_size;
+	size_t n = len < sizeof(w->seq) ? len : sizeof(w->seq);
+	ssize_t rc;
+
+	w->seq++;
+	memcpy(msg, &w->seq, n);
+	if (send(sock, msg, len, 0) == -1)
+		return -1;
+
+	do {
+		rc = recv(sock, reply, len, 0);
+	} while (rc == (ssize_t) len && memcmp(reply, msg, n));
+	return rc == (ssize_t) len ? 0 : -1;
+}
+
+/*
+ * Sends one request and waits for the reply.  Returns 0 on success, or -1.
+ */
+static int loadgen_request(struct loadgen_worker *w, int sock, char *msg,
+		char *reply)
+{
+	const struct loadgen_config *cfg = w->cfg;
+	char *data;
+	ssize_t rc;
+
+	if (cfg->socktype == SOCK_UDP)
+		return loadgen_request_udp(w, sock, msg, reply);
+
+	if (cfg->framing == FRAME_NETSTRING) {
+		if (netstring_send(sock, cfg->msg_size, msg) < 0)
+			return -1;
+		rc = netstring_read(sock, &data);
+		if (rc > 0)
+			free(data);
+		return rc == (ssize_t) cfg->msg_size ? 0 : -1;
+	}
+
+	if (cfg->framing == FRAME_VARINT) {
+		if (varint_send(sock, cfg->msg_size, msg) < 0)
+			return -1;
+		rc = varint_read(sock, &data);
+		if (rc > 0)
+			free(data);
+		return rc == (ssize_t) cfg->msg_size ? 0 : -1;
+	}
+
+	if (tcp_send_bytes(sock, msg, cfg->msg_size) < 0)
+		return -1;
+	rc = tcp_read_bytes(sock, reply, cfg->msg_size);
+	return rc == (ssize_t) cfg->msg_size ? 0 : -1;
+}
+
+static void *loadgen_thread(void *data)
+{
+	struct loadgen_worker *w = data;
+	const struct loadgen_config *cfg = w->cfg;
+	char *msg, *reply;
+	uint64_t start;
+	int sock = -1;
+
+	msg = malloc(cfg->msg_size);
+	reply = malloc(cfg->msg_size);
+	if (!msg || !reply)
+		goto out;
+
+	/* avoid '0' so that netstring payloads never look like a terminator */
+	memset(msg, 'x', cfg->msg_size);
+
+	while ((start = now_ns()) < w->deadline) {
+		if (sock == -1 && (sock = loadgen_connect(w)) == -1) {
+			w->errors++;
+			continue;
+		}
+
+		if (loadgen_request(w, sock, msg, reply)) {
+			w->errors++;
+			if (cfg->socktype == SOCK_TCP) {
+				close(sock);
+				sock = -1;
+			}
+			continue;
+		}
+
+		hist_record(&w->latency, now_ns() - start);
+		w->requests++;
+
+		if (cfg->reconnect && cfg->socktype == SOCK_TCP) {
+			close(sock);
+			sock = -1;
+		}
+	}
+out:
+	if (sock != -1)
+		close(sock);
+	free(msg);
+	free(reply);
+	return NULL;
+}
+
+/*
+ * Echo callbacks.  A TCP connection is echoed a message at a time, in the
+ * framing of the load, until the client closes it.
+ */
+static void *echo_tcp(void *data)
+{
+	struct msg_info *m = data;
+	char buf[4096], *msg;
+	ssize_t n;
+
+	for (;;) {
+		if (echo.framing == FRAME_NETSTRING) {
+			if ((n = netstring_read(m->sock, &msg)) <= 0)
+				break;
+			n = netstring_send(m->sock, n, msg);
+			free(msg);
+		} else if (echo.framing == FRAME_VARINT) {
+			if ((n = varint_read(m->sock, &msg)) <= 0)
+				break;
+			n = varint_send(m->sock, n, msg);
+			free(msg);
+		} else {
+			if ((n = recv(m->sock, buf, sizeof(buf), 0)) <= 0)
+				break;
+			n = tcp_send_bytes(m->sock, buf, n);
+		}
+		if (n < 0)
+			break;
+	}
+	service_exit(m);
+}
+
+static void *echo_udp(void *data)
+{
+	struct msg_info *m = data;
+
+	sendto(m->sock, m->msg, m->len, 0, (struct sockaddr*) &m->addr,
+			sizeof(m->addr));
+	service_exit(m);
+}
+
+static void echo_batch(struct msg_info *m, struct udp_batch *batch)
+{
+	udp_batch_reply(batch, m, m->msg, m->len);
+}
+
+/*
+ * Echo callback of the event loop.  Bytes are echoed as they arrive, which
+ * echoes every framing of the load unchanged.
+ */
+static int echo_recv(struct ev_conn *conn, const char *buf, size_t len)
+{
+	return ev_send(conn, buf, len) ? EV_CLOSE : EV_OK;
+}
+
+static const struct ev_ops echo_ops = {
+	.recv = echo_recv
+};
+
+static void *echo_main(void *data)
+{
+	(void) data;
+
+	if (echo.mode == SERVE_EPOLL || echo.mode == SERVE_URING)
+		ev_loop_run(&echo.loop);
+	if (echo.socktype == SOCK_TCP)
+		tcp_server_main(echo.sock, echo.threads, echo_tcp);
+
+	switch (echo.mode) {
+	case SERVE_POOL:
+		udp_server_pool_main(echo.sock, echo.threads, ECHO_QUEUE_LEN,
+				echo_udp);
+	case SERVE_BATCH:
+		udp_server_batch_main(echo.sock, ECHO_BATCH, echo_batch);
+	default:
+		udp_server_main(echo.sock, echo.threads, echo_udp);
+	}
+}
+
+/*
+ * Starts an echo server for the load described by `cfg' on cfg->port, in
+ * this process.  `mode' is one of the SERVE_* modes; `threads' is the thread
+ * limit (per shard with SERVE_SHARDS), the number of workers with SERVE_POOL,
+ * or the connection limit of an event loop.  Shards are not pinned.  The
+ * server runs until the process exits.  Returns 0 on success, or -1 if the
+ * mode does not apply to the socket type, the event loop backend is not
+ * supported, or the server thread could not be started.
+ */
+int loadgen_serve(const struct loadgen_config *cfg, int mode, int threads)
+{
+	char *port = (char*) cfg->port;
+	pthread_t tid;
+	int nr = 0, rc;
+
+	if ((mode == SERVE_POOL || mode == SERVE_BATCH)
+			&& cfg->socktype != SOCK_UDP)
+		return -1;
+	if ((mode == SERVE_EPOLL || mode == SERVE_URING)
+			&& cfg->socktype != SOCK_TCP)
+		return -1;
+
+	echo.socktype = cfg->socktype;
+	echo.framing = cfg->framing;
+	echo.mode = mode;
+	echo.threads = threads;
+
+	if (mode == SERVE_SHARDS) {
+		if (cfg->socktype == SOCK_TCP)
+			tcp_server_shards(port, &nr, 0, threads, echo_tcp);
+		else
+			udp_server_shards(port, &nr, 0, threads, echo_udp);
+		return 0;
+	}
+
+	/* bind before returning, so that the load never races the server */
+	echo.sock = cfg->socktype == SOCK_TCP ? tcp_server_init(port)
+		: udp_server_init(port);
+
+	if (mode == SERVE_EPOLL || mode == SERVE_URING) {
+		rc = ev_loop_init(&echo.loop, echo.sock, threads, &echo_ops,
+				mode == SERVE_EPOLL ? EV_BACKEND_EPOLL
+				: EV_BACKEND_URING);
+		if (rc) {
+			fprintf(stderr, "ev_loop_init: %s\n", strerror(-rc));
+			close(echo.sock);
+			return -1;
+		}
+	}
+
+	if (pthread_create(&tid, NULL, echo_main, NULL)) {
+		perror("pthread_create");
+		return -1;
+	}
+	pthread_detach(tid);
+	return 0;
+}
+
+/*
+ * Runs a load test.  Returns 0 on success, or -1 if the test could not be
+ * started.
+ */
+int loadgen_run(const struct loadgen_config *cfg,
+		struct loadgen_report *report)
+{
+	struct addrinfo hints, *ai;
+	struct loadgen_worker *workers;
+	uint64_t start, deadline;
+	int rc, started = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = cfg->socktype == SOCK_UDP ? SOCK_DGRAM
+		: SOCK_STREAM;
+
+	if ((rc = getaddrinfo(cfg->host, cfg->port, &hints, &ai))) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+		return -1;
+	}
+
+	if (!(workers = calloc(cfg->conns, sizeof(struct loadgen_worker)))) {
+		freeaddrinfo(ai);
+		return -1;
+	}
+
+	start = now_ns();
+	deadline = start + cfg->duration * 1000000000ULL;
+
+	for (int i = 0; i < cfg->conns; i++) {
+		workers[i].cfg = cfg;
+		workers[i].ai = ai;
+		workers[i].deadline = deadline;
+		if (pthread_create(&workers[i].tid, NULL, loadgen_thread,
+					&workers[i])) {
+			perror("pthread_create");
+			break;
+		}
+		started++;
+	}
+
+	memset(report, 0, sizeof(*report));
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i].tid, NULL);
+
+		report->requests += workers[i].requests;
+		report->errors += workers[i].errors;
+		report->latency.count += workers[i].latency.count;
+		if (workers[i].latency.max > report->latency.max)
+			report->latency.max = workers[i].latency.max;
+		for (int j = 0; j < HIST_BUCKETS; j++)
+			report->latency.buckets[j] +=
+				workers[i].latency.buckets[j];
+	}
+	report->elapsed = (now_ns() - start) / 1e9;
+
+	free(workers);
+	freeaddrinfo(ai);
+	return started ? 0 : -1;
+}
+
+void loadgen_print(const struct loadgen_report *r, FILE *f)
+{
+	const struct histogram *h = &r->latency;
+
+	fprintf(f, "requests    %lu\n", r->requests);
+	fprintf(f, "errors      %lu\n", r->errors);
+	fprintf(f, "throughput  %.0f req/s\n", r->requests / r->elapsed);
+	fprintf(f, "latency p50  %8.1f us\n", hist_percentile(h, 50.0) / 1e3);
+	fprintf(f, "latency p99  %8.1f us\n", hist_percentile(h, 99.0) / 1e3);
+	fprintf(f, "latency p999 %8.1f us\n", hist_percentile(h, 99.9) / 1e3);
+	fprintf(f, "latency max  %8.1f us\n", h->max / 1e3);
+}
+
+#ifdef LOADGEN_MAIN
+static _Noreturn void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-u] [-n | -v] [-r] [-c conns] [-s size] "
+			"[-d seconds] [-t timeout_ms] [-S mode [-T threads]] "
+			"host port\n"
+			"  -u  UDP instead of TCP\n"
+			"  -n  netstring framing\n"
+			"  -v  varint framing\n"
+			"  -r  reconnect for every request\n"
+			"  -S  start an echo server on port in-process first;\n"
+			"      mode is thread, pool, batch, shards, epoll or uring\n"
+			"  -T  server thread or connection limit "
+			"(default: 4 * conns)\n", name);
+	exit(EXIT_FAILURE);
+}
+
+static int serve_mode(const char *name)
+{
+	static const char *const modes[] = {
+		[SERVE_THREAD] = "thread",
+		[SERVE_POOL]   = "pool",
+		[SERVE_BATCH]  = "batch",
+		[SERVE_SHARDS] = "shards",
+		[SERVE_EPOLL]  = "epoll",
+		[SERVE_URING]  = "uring",
+	};
+
+	for (size_t i = 0; i < sizeof(modes) / sizeof(*modes); i++)
+		if (!strcmp(name, modes[i]))
+			return i;
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct loadgen_report report;
+	struct loadgen_config cfg = {
+		.socktype   = SOCK_TCP,
+		.framing    = FRAME_RAW,
+		.conns      = 1,
+		.msg_size   = 64,
+		.duration   = 10,
+		.timeout_ms = 1000,
+	};
+	int opt, mode = -1, threads = 0;
+	const char *serve = NULL;
+
+	while ((opt = getopt(argc, argv, "unvrc:s:d:t:S:T:")) != -1) {
+		switch (opt) {
+		case 'u': cfg.socktype = SOCK_UDP;            break;
+		case 'n': cfg.framing = FRAME_NETSTRING;      break;
+		case 'v': cfg.framing = FRAME_VARINT;         break;
+		case 'r': cfg.reconnect = 1;                  break;
+		case 'c': cfg.conns = atoi(optarg);           break;
+		case 's': cfg.msg_size = atol(optarg);        break;
+		case 'd': cfg.duration = atoi(optarg);        break;
+		case 't': cfg.timeout_ms = atoi(optarg);      break;
+		case 'S': serve = optarg;                     break;
+		case 'T': threads = atoi(optarg);             break;
+		default:  usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2 || cfg.conns < 1 || !cfg.msg_size)
+		usage(argv[0]);
+
+	if (serve && (mode = serve_mode(serve)) < 0)
+		usage(argv[0]);
+
+	cfg.host = argv[optind];
+	cfg.port = argv[optind+1];
+
+	/*
+	 * A handler holds its slot a little past its reply, so a limit of
+	 * exactly `conns' would shed some of the load's own requests.
+	 */
+	if (mode >= 0 && loadgen_serve(&cfg, mode, threads ? threads
+				: 4 * cfg.conns)) {
+		fprintf(stderr, "can't start a %s server for this load\n",
+				serve);
+		return EXIT_FAILURE;
+	}
+
+	if (loadgen_run(&cfg, &report))
+		return EXIT_FAILURE;
+
+	loadgen_print(&report, stdout);
+	return EXIT_SUCCESS;
+}
+#endif
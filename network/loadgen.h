@@ -0,0 +1,69 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _LOADGEN_H
+#define _LOADGEN_H
+
+#include <stdio.h>
+
+#include "metrics.h"
+
+enum {
+	FRAME_RAW,                 // replies are exactly msg_size bytes
+	FRAME_NETSTRING,
+	FRAME_VARINT
+};
+
+/*
+ * A load test against an echo service: each connection sends a message and
+ * waits for the reply before sending the next one.
+ */
+struct loadgen_config {
+	const char *host;
+	const char *port;
+	int socktype;              // SOCK_TCP or SOCK_UDP (server.h)
+	int framing;               // FRAME_* (TCP only)
+	int conns;                 // concurrent connections
+	size_t msg_size;
+	unsigned int duration;     // seconds
+	unsigned int timeout_ms;   // reply timeout
+	int reconnect;             // new TCP connection for every request
+};
+
+/* modes of the in-process echo server (loadgen_serve()) */
+enum {
+	SERVE_THREAD,              // tcp_server_main() or udp_server_main()
+	SERVE_POOL,                // udp_server_pool_main() (UDP only)
+	SERVE_BATCH,               // udp_server_batch_main() (UDP only)
+	SERVE_SHARDS,              // tcp_server_shards() or udp_server_shards()
+	SERVE_EPOLL,               // evserver.c event loop on epoll (TCP only)
+	SERVE_URING                // evserver.c event loop on io_uring (TCP only)
+};
+
+struct loadgen_report {
+	unsigned long requests;    // requests answered
+	unsigned long errors;      // failed or timed out
+	double elapsed;            // seconds
+	struct histogram latency;  // request latency in nanoseconds
+};
+
+int loadgen_serve(const struct loadgen_config *cfg, int mode, int threads);
+int loadgen_run(const struct loadgen_config *cfg,
+		struct loadgen_report *report);
+void loadgen_print(const struct loadgen_report *report, FILE *f);
+
+#endif
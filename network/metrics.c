@@ -0,0 +1,362 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* metrics.c
+ *
+ * This file implements server metrics: counters and a latency histogram.
+ * Each thread records into its own block, so recording is a thread-local
+ * relaxed load and store with no locking or shared cache lines.  Blocks are
+ * only locked when a thread registers or exits, and when the blocks are
+ * summed on demand by metrics_snapshot().  When a thread exits its block is
+ * folded into a running total and recycled, since server threads are often
+ * short-lived.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+struct metrics_block {
+	struct metrics_block *next;
+	atomic_ulong counters[NR_METRICS];
+	atomic_ulong count;
+	atomic_ullong max;
+	atomic_ulong buckets[HIST_BUCKETS];
+};
+
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t blocks_once = PTHREAD_ONCE_INIT;
+static pthread_key_t blocks_key;
+static struct metrics_block *active;   // blocks owned by running threads
+static struct metrics_block *spare;    // blocks of exited threads
+static struct metrics retired;         // totals from exited threads
+
+static _Thread_local struct metrics_block *self;
+
+static inline unsigned int hist_index(uint64_t value)
+{
+	unsigned int exp;
+
+	if (value < HIST_SUB)
+		return value;
+
+	exp = 63 - __builtin_clzll(value);
+	return (exp - HIST_SUB_BITS + 1) * HIST_SUB
+		+ ((value >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * Returns the smallest value which falls in bucket `index'.
+ */
+static inline uint64_t hist_value(unsigned int index)
+{
+	unsigned int exp;
+
+	if (index < HIST_SUB)
+		return index;
+
+	exp = index / HIST_SUB + HIST_SUB_BITS - 1;
+	return (uint64_t) (HIST_SUB + index % HIST_SUB)
+		<< (exp - HIST_SUB_BITS);
+}
+
+void hist_record(struct histogram *hist, uint64_t value)
+{
+	hist->buckets[hist_index(value)]++;
+	hist->count++;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+/*
+ * Returns (an approximation of) the value below which `pct' percent of the
+ * recorded values fall.
+ */
+uint64_t hist_percentile(const struct histogram *hist, double pct)
+{
+	unsigned long rank, seen = 0;
+
+	if (!hist->count)
+		return 0;
+
+	rank = (unsigned long) (hist->count * pct / 100.0);
+	if (rank >= hist->count)
+		rank = hist->count - 1;
+
+	for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen > rank)
+			return hist_value(i) < hist->max ? hist_value(i)
+				: hist->max;
+	}
+	return hist->max;
+}
+
+#define LOAD(x)     atomic_load_explicit(&(x), memory_order_relaxed)
+#define STORE(x, v) atomic_store_explicit(&(x), (v), memory_order_relaxed)
+
+/*
+ * Adds a block's numbers into an aggregate.
+ */
+static void block_sum(struct metrics *sum, struct metrics_block *block)
+{
+	unsigned long max;
+
+	for (int i = 0; i < NR_METRICS; i++)
+		sum->counters[i] += LOAD(block->counters[i]);
+
+	for (int i = 0; i < HIST_BUCKETS; i++)
+		sum->latency.buckets[i] += LOAD(block->buckets[i]);
+
+	sum->latency.count += LOAD(block->count);
+	if ((max = LOAD(block->max)) > sum->latency.max)
+		sum->latency.max = max;
+}
+
+/*
+ * Thread exit: retire the thread's block.
+ */
+static void block_exit(void *data)
+{
+	struct metrics_block *block = data, **it;
+
+	pthread_mutex_lock(&blocks_lock);
+
+	block_sum(&retired, block);
+
+	for (it = &active; *it != block; it = &(*it)->next)
+		;
+	*it = block->next;
+
+	memset(block, 0, sizeof(*block));
+	block->next = spare;
+	spare = block;
+
+	pthread_mutex_unlock(&blocks_lock);
+	self = NULL;
+}
+
+static void blocks_init(void)
+{
+	pthread_key_create(&blocks_key, block_exit);
+}
+
+/*
+ * Returns the calling thread's block, registering one if necessary.
+ */
+static struct metrics_block *block_get(void)
+{
+	struct metrics_block *block;
+
+	if (self)
+		return self;
+
+	pthread_once(&blocks_once, blocks_init);
+	pthread_mutex_lock(&blocks_lock);
+
+	if ((block = spare))
+		spare = block->next;
+	else if (!(block = calloc(1, sizeof(struct metrics_block)))) {
+		pthread_mutex_unlock(&blocks_lock);
+		return NULL;
+	}
+
+	block->next = active;
+	active = block;
+
+	pthread_mutex_unlock(&blocks_lock);
+
+	pthread_setspecific(blocks_key, block);
+	return self = block;
+}
+
+void metrics_add(enum metric metric, unsigned long n)
+{
+	struct metrics_block *block = block_get();
+
+	if (block)
+		STORE(block->counters[metric], LOAD(block->counters[metric]) + n);
+}
+
+void metrics_record_latency(uint64_t ns)
+{
+	struct metrics_block *block = block_get();
+	unsigned int i = hist_index(ns);
+
+	if (!block)
+		return;
+
+	STORE(block->buckets[i], LOAD(block->buckets[i]) + 1);
+	STORE(block->count, LOAD(block->count) + 1);
+	if (ns > LOAD(block->max))
+		STORE(block->max, ns);
+}
+
+/*
+ * Sums the metrics of every thread, past and present.
+ */
+void metrics_snapshot(struct metrics *metrics)
+{
+	struct metrics_block *it;
+
+	pthread_mutex_lock(&blocks_lock);
+
+	*metrics = retired;
+	for (it = active; it; it = it->next)
+		block_sum(metrics, it);
+
+	pthread_mutex_unlock(&blocks_lock);
+}
+
+/*
+ * Formats a snapshot as text, one "name value" pair per line.  Returns the
+ * length of the text, as snprintf().
+ */
+int metrics_format(const struct metrics *m, char *buf, size_t size)
+{
+	const struct histogram *h = &m->latency;
+
+	return snprintf(buf, size,
+			"accepted %lu\n"
+			"rejected %lu\n"
+			"recv_errors %lu\n"
+			"bytes_in %lu\n"
+			"bytes_out %lu\n"
+			"syscalls_in %lu\n"
+			"syscalls_out %lu\n"
+			"pool_hits %lu\n"
+			"pool_misses %lu\n"
+			"pool_frees %lu\n"
+			"latency_count %lu\n"
+			"latency_p50_ns %llu\n"
+			"latency_p90_ns %llu\n"
+			"latency_p99_ns %llu\n"
+			"latency_p999_ns %llu\n"
+			"latency_max_ns %llu\n",
+			m->counters[METRIC_ACCEPTED],
+			m->counters[METRIC_REJECTED],
+			m->counters[METRIC_RECV_ERRORS],
+			m->counters[METRIC_BYTES_IN],
+			m->counters[METRIC_BYTES_OUT],
+			m->counters[METRIC_SYSCALLS_IN],
+			m->counters[METRIC_SYSCALLS_OUT],
+			m->counters[METRIC_POOL_HITS],
+			m->counters[METRIC_POOL_MISSES],
+			m->counters[METRIC_POOL_FREES],
+			h->count,
+			(unsigned long long) hist_percentile(h, 50.0),
+			(unsigned long long) hist_percentile(h, 90.0),
+			(unsigned long long) hist_percentile(h, 99.0),
+			(unsigned long long) hist_percentile(h, 99.9),
+			(unsigned long long) h->max);
+}
+
+/*
+ * Stats thread: writes a snapshot to each client that connects, then closes
+ * the connection.
+ */
+static void *stats_thread(void *data)
+{
+	int sock = (int) (long) data;
+	struct metrics *m;
+	char buf[1024];
+	int client, len;
+
+	pthread_detach(pthread_self());
+
+	if (!(m = malloc(sizeof(struct metrics))))
+		return NULL;
+
+	for (;;) {
+		client = accept(sock, NULL, NULL);
+		if (client == -1) {
+			syslog(LOG_ERR, "stats accept: %m\n");
+			continue;
+		}
+
+		metrics_snapshot(m);
+		len = metrics_format(m, buf, sizeof(buf));
+		send(client, buf, len, MSG_NOSIGNAL);
+		close(client);
+	}
+	return NULL;
+}
+
+/*
+ * Opens a listening socket on `port'.  Unlike the servers' sockets, failure
+ * isn't fatal: the stats port is an optional extra.  Returns the socket, or
+ * -1 on failure.
+ */
+static int stats_listen(const char *port)
+{
+	struct addrinfo hints, *servinfo, *p;
+	const int yes = 1;
+	int sock = -1, rc;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags    = AI_PASSIVE;
+
+	if ((rc = getaddrinfo(NULL, port, &hints, &servinfo))) {
+		syslog(LOG_ERR, "stats getaddrinfo: %s\n", gai_strerror(rc));
+		return -1;
+	}
+
+	for (p = servinfo; p; p = p->ai_next) {
+		sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (sock == -1)
+			continue;
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		if (!bind(sock, p->ai_addr, p->ai_addrlen) && !listen(sock, 16))
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(servinfo);
+
+	if (sock == -1)
+		syslog(LOG_ERR, "stats: failed to listen on port %s\n", port);
+	return sock;
+}
+
+/*
+ * Serves metrics snapshots as text on a TCP port.  Returns 0 on success, or
+ * -1 if the port couldn't be opened or the stats thread couldn't be started.
+ */
+int metrics_serve(char *port)
+{
+	pthread_t tid;
+	int sock;
+
+	if ((sock = stats_listen(port)) == -1)
+		return -1;
+
+	if (pthread_create(&tid, NULL, stats_thread, (void*) (long) sock)) {
+		close(sock);
+		return -1;
+	}
+	return 0;
+}
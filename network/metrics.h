@@ -0,0 +1,70 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum metric {
+	METRIC_ACCEPTED,           // connections/datagrams dispatched
+	METRIC_REJECTED,           // dropped at the thread limit
+	METRIC_RECV_ERRORS,        // failed accept/recv calls
+	METRIC_BYTES_IN,
+	METRIC_BYTES_OUT,
+	METRIC_SYSCALLS_IN,        // receive calls made by network.c
+	METRIC_SYSCALLS_OUT,       // send calls made by network.c
+	METRIC_POOL_HITS,          // messages allocated from the pool
+	METRIC_POOL_MISSES,        // messages allocated with malloc
+	METRIC_POOL_FREES,         // messages returned to the pool
+	NR_METRICS
+};
+
+/*
+ * Log-linear ("HDR-style") histogram buckets: values below 2^HIST_SUB_BITS
+ * get a bucket each, and every power of two above that is split into
+ * 2^HIST_SUB_BITS buckets, for a relative error of at most 1/16.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+	unsigned long count;
+	uint64_t max;
+	unsigned long buckets[HIST_BUCKETS];
+};
+
+/*
+ * An aggregate of every thread's metrics.
+ */
+struct metrics {
+	unsigned long counters[NR_METRICS];
+	struct histogram latency;  // handler time in nanoseconds
+};
+
+void hist_record(struct histogram *hist, uint64_t value);
+uint64_t hist_percentile(const struct histogram *hist, double pct);
+
+void metrics_add(enum metric metric, unsigned long n);
+void metrics_record_latency(uint64_t ns);
+void metrics_snapshot(struct metrics *metrics);
+int metrics_format(const struct metrics *metrics, char *buf, size_t size);
+int metrics_serve(char *port);
+
+#endif
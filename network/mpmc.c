@@ -0,0 +1,132 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* mpmc.c
+ *
+ * This file implements a bounded multi-producer/multi-consumer queue (after
+ * Dmitry Vyukov's design).  Each cell carries a sequence number which tells
+ * producers and consumers whether the cell is free, full, or still being
+ * written by another thread, so that both ends can claim a slot with a single
+ * compare-and-swap on their cursor.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "mpmc.h"
+
+/*
+ * Initializes a queue with room for at least `size' elements.  The capacity
+ * is rounded up to a power of two.  Returns 0 on success, or a negative error
+ * number.
+ */
+int mpmc_init(struct mpmc_queue *q, size_t size)
+{
+	size_t cap = 2;
+
+	while (cap < size)
+		cap <<= 1;
+
+	q->cells = malloc(cap * sizeof(struct mpmc_cell));
+	if (!q->cells)
+		return -ENOMEM;
+
+	for (size_t i = 0; i < cap; i++)
+		atomic_init(&q->cells[i].seq, i);
+
+	q->mask = cap - 1;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	return 0;
+}
+
+void mpmc_destroy(struct mpmc_queue *q)
+{
+	free(q->cells);
+	q->cells = NULL;
+}
+
+/*
+ * Appends an element to the queue.  Returns 0 on success, or -1 if the queue
+ * is full.
+ */
+int mpmc_push(struct mpmc_queue *q, void *data)
+{
+	struct mpmc_cell *cell;
+	size_t pos, seq;
+	long diff;
+
+	pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		diff = (long) seq - (long) pos;
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->head, &pos,
+					pos + 1, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = atomic_load_explicit(&q->head,
+					memory_order_relaxed);
+		}
+	}
+
+	cell->data = data;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+	return 0;
+}
+
+/*
+ * Removes the element at the front of the queue.  Returns NULL if the queue
+ * is empty, or if the element at the front has been claimed but not yet
+ * written by a producer.
+ */
+void *mpmc_pop(struct mpmc_queue *q)
+{
+	struct mpmc_cell *cell;
+	size_t pos, seq;
+	long diff;
+	void *data;
+
+	pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		diff = (long) seq - (long) (pos + 1);
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->tail, &pos,
+					pos + 1, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&q->tail,
+					memory_order_relaxed);
+		}
+	}
+
+	data = cell->data;
+	atomic_store_explicit(&cell->seq, pos + q->mask + 1,
+			memory_order_release);
+	return data;
+}
@@ -0,0 +1,48 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _MPMC_H
+#define _MPMC_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE 64
+
+struct mpmc_cell {
+	atomic_size_t seq;
+	void *data;
+};
+
+/*
+ * A bounded, lock-free, multi-producer/multi-consumer FIFO of pointers.  The
+ * producer and consumer cursors live on separate cache lines so that the two
+ * sides don't contend with each other.
+ */
+struct mpmc_queue {
+	size_t mask;
+	struct mpmc_cell *cells;
+	_Alignas(CACHE_LINE) atomic_size_t head; // next slot to enqueue
+	_Alignas(CACHE_LINE) atomic_size_t tail; // next slot to dequeue
+};
+
+int mpmc_init(struct mpmc_queue *q, size_t size);
+void mpmc_destroy(struct mpmc_queue *q);
+int mpmc_push(struct mpmc_queue *q, void *data);
+void *mpmc_pop(struct mpmc_queue *q);
+
+#endif
@@ -0,0 +1,244 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* msgbuf.c
+ *
+ * This file implements a growable message buffer with a pooled backing
+ * store.  Buffers are rounded up to a power of two between MSGBUF_MIN and
+ * MSGBUF_MAX, and released buffers are kept in a small per-thread cache for
+ * each size, so that building a message normally costs no call to malloc.
+ * Larger buffers bypass the pool.  A thread's cache is freed when the thread
+ * exits.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+#include "msgbuf.h"
+
+#define MSGBUF_MIN_SHIFT 8
+#define MSGBUF_MAX_SHIFT 16
+#define MSGBUF_MIN       (1UL << MSGBUF_MIN_SHIFT)
+#define MSGBUF_MAX       (1UL << MSGBUF_MAX_SHIFT)
+#define MSGBUF_CLASSES   (MSGBUF_MAX_SHIFT - MSGBUF_MIN_SHIFT + 1)
+#define MSGBUF_CACHED    8   // buffers kept per class and thread
+
+struct msgbuf_free {
+	struct msgbuf_free *next;
+};
+
+struct msgbuf_cache {
+	struct msgbuf_free *head[MSGBUF_CLASSES];
+	unsigned int nr[MSGBUF_CLASSES];
+};
+
+static _Thread_local struct msgbuf_cache cache;
+
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+static void cache_exit(void *data)
+{
+	struct msgbuf_cache *c = data;
+	struct msgbuf_free *it, *next;
+
+	for (int i = 0; i < MSGBUF_CLASSES; i++) {
+		for (it = c->head[i]; it; it = next) {
+			next = it->next;
+			free(it);
+		}
+		c->head[i] = NULL;
+		c->nr[i] = 0;
+	}
+}
+
+static void cache_init(void)
+{
+	pthread_key_create(&cache_key, cache_exit);
+}
+
+/*
+ * Returns the size class for a buffer of `size' bytes, or -1 if it is too
+ * large to be pooled.
+ */
+static int size_class(size_t size)
+{
+	int shift = MSGBUF_MIN_SHIFT;
+
+	while ((1UL << shift) < size)
+		if (++shift > MSGBUF_MAX_SHIFT)
+			return -1;
+	return shift - MSGBUF_MIN_SHIFT;
+}
+
+static char *buf_alloc(size_t *size)
+{
+	struct msgbuf_free *buf;
+	int class = size_class(*size);
+
+	if (class < 0)
+		return malloc(*size);
+
+	*size = MSGBUF_MIN << class;
+	if ((buf = cache.head[class])) {
+		cache.head[class] = buf->next;
+		cache.nr[class]--;
+		return (char*) buf;
+	}
+	return malloc(*size);
+}
+
+static void buf_free(char *mem, size_t size)
+{
+	struct msgbuf_free *buf = (struct msgbuf_free*) mem;
+	int class = size_class(size);
+
+	if (class < 0 || cache.nr[class] >= MSGBUF_CACHED) {
+		free(mem);
+		return;
+	}
+
+	/* make sure the cache is freed when the thread exits */
+	pthread_once(&cache_once, cache_init);
+	if (!pthread_getspecific(cache_key))
+		pthread_setspecific(cache_key, &cache);
+
+	buf->next = cache.head[class];
+	cache.head[class] = buf;
+	cache.nr[class]++;
+}
+
+/*
+ * Initializes a message buffer with room for a message of `size' bytes.
+ * Returns 0 on success, or a negative error number.
+ */
+int msgbuf_init(struct msgbuf *mb, size_t size)
+{
+	mb->size = MSGBUF_HEADROOM + size + 1;
+	mb->len = 0;
+	if (!(mb->mem = buf_alloc(&mb->size)))
+		return -ENOMEM;
+	return 0;
+}
+
+/*
+ * Returns a message buffer's memory to the pool.
+ */
+void msgbuf_release(struct msgbuf *mb)
+{
+	if (mb->mem)
+		buf_free(mb->mem, mb->size);
+	mb->mem = NULL;
+	mb->size = 0;
+	mb->len = 0;
+}
+
+/*
+ * Makes sure there is room to append `len' bytes.  Returns 0 on success, or
+ * a negative error number.
+ */
+int msgbuf_reserve(struct msgbuf *mb, size_t len)
+{
+	size_t need = MSGBUF_HEADROOM + mb->len + len + 1;
+	size_t size;
+	char *mem;
+
+	if (need <= mb->size)
+		return 0;
+
+	size = need < mb->size * 2 ? mb->size * 2 : need;
+	if (!(mem = buf_alloc(&size)))
+		return -ENOMEM;
+
+	memcpy(mem + MSGBUF_HEADROOM, msgbuf_data(mb), mb->len);
+	buf_free(mb->mem, mb->size);
+	mb->mem = mem;
+	mb->size = size;
+	return 0;
+}
+
+int msgbuf_append(struct msgbuf *mb, const void *data, size_t len)
+{
+	int rc;
+
+	if ((rc = msgbuf_reserve(mb, len)))
+		return rc;
+	memcpy(msgbuf_data(mb) + mb->len, data, len);
+	mb->len += len;
+	return 0;
+}
+
+/* integers are appended in network byte order */
+
+int msgbuf_put_u16(struct msgbuf *mb, uint16_t v)
+{
+	v = htons(v);
+	return msgbuf_append(mb, &v, sizeof(v));
+}
+
+int msgbuf_put_u32(struct msgbuf *mb, uint32_t v)
+{
+	v = htonl(v);
+	return msgbuf_append(mb, &v, sizeof(v));
+}
+
+int msgbuf_put_u64(struct msgbuf *mb, uint64_t v)
+{
+	v = htobe64(v);
+	return msgbuf_append(mb, &v, sizeof(v));
+}
+
+/*
+ * Appends formatted output.  The buffer grows as needed, so the output is
+ * never truncated.  Returns 0 on success, or a negative error number.
+ */
+int msgbuf_vprintf(struct msgbuf *mb, const char *fmt, va_list ap)
+{
+	size_t room = mb->size - MSGBUF_HEADROOM - mb->len - 1;
+	va_list aq;
+	int len, rc;
+
+	va_copy(aq, ap);
+	len = vsnprintf(msgbuf_data(mb) + mb->len, room + 1, fmt, aq);
+	va_end(aq);
+	if (len < 0)
+		return -EINVAL;
+
+	if ((size_t) len > room) {
+		if ((rc = msgbuf_reserve(mb, len)))
+			return rc;
+		vsnprintf(msgbuf_data(mb) + mb->len, len + 1, fmt, ap);
+	}
+	mb->len += len;
+	return 0;
+}
+
+int msgbuf_printf(struct msgbuf *mb, const char *fmt, ...)
+{
+	va_list ap;
+	int rc;
+
+	va_start(ap, fmt);
+	rc = msgbuf_vprintf(mb, fmt, ap);
+	va_end(ap);
+	return rc;
+}
@@ -0,0 +1,56 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _MSGBUF_H
+#define _MSGBUF_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* room reserved in front of a message for a framing prefix */
+#define MSGBUF_HEADROOM 24
+
+/*
+ * A growable buffer for building an outgoing message.  The message starts
+ * MSGBUF_HEADROOM bytes into the buffer, so that a netstring or varint prefix
+ * can be written in front of it, and there is always room for one byte after
+ * it, so that the message can be framed and sent without being copied.
+ * Buffers come from a per-thread pool of power-of-two size classes.
+ */
+struct msgbuf {
+	char *mem;
+	size_t size;               // capacity of `mem'
+	size_t len;                // length of the message
+};
+
+static inline char *msgbuf_data(const struct msgbuf *mb)
+{
+	return mb->mem + MSGBUF_HEADROOM;
+}
+
+int msgbuf_init(struct msgbuf *mb, size_t size);
+void msgbuf_release(struct msgbuf *mb);
+int msgbuf_reserve(struct msgbuf *mb, size_t len);
+int msgbuf_append(struct msgbuf *mb, const void *data, size_t len);
+int msgbuf_put_u16(struct msgbuf *mb, uint16_t v);
+int msgbuf_put_u32(struct msgbuf *mb, uint32_t v);
+int msgbuf_put_u64(struct msgbuf *mb, uint64_t v);
+int msgbuf_printf(struct msgbuf *mb, const char *fmt, ...);
+int msgbuf_vprintf(struct msgbuf *mb, const char *fmt, va_list ap);
+
+#endif
@@ -0,0 +1,114 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* msgpool.c
+ *
+ * This file implements a pool allocator for struct msg_info.  Each message
+ * is allocated together with a MSG_MAX byte receive buffer, so a message costs
+ * a single allocation, and freed messages are recycled rather than returned
+ * to malloc.
+ *
+ * Messages are typically allocated by a server loop and freed by whichever
+ * handler thread serviced them.  Freed messages are therefore pushed onto a
+ * shared lock-free stack, from which an allocating thread takes all of them
+ * at once into its own private cache.  Since the stack is only ever emptied
+ * as a whole, pushing with compare-and-swap is free of the ABA problem.
+ * Frees made by a thread that allocates go straight to its private cache.
+ *
+ * The pool's counters are kept in each thread's metrics block, so counting
+ * costs no shared cache line either.
+ */
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "metrics.h"
+#include "msgpool.h"
+
+struct msg_slot {
+	struct msg_info info;      // must be first
+	struct msg_slot *next;
+	char buf[MSG_MAX];
+};
+
+static _Atomic(struct msg_slot*) shared;
+
+static _Thread_local struct msg_slot *cache;
+static _Thread_local int allocator;
+
+/*
+ * Returns a message whose `msg' field points to a MSG_MAX byte buffer, or
+ * NULL if memory is exhausted.  The rest of the message is uninitialized.
+ */
+struct msg_info *msg_alloc(void)
+{
+	struct msg_slot *slot;
+
+	allocator = 1;
+
+	if (!cache)
+		cache = atomic_exchange_explicit(&shared, NULL,
+				memory_order_acquire);
+
+	if ((slot = cache)) {
+		cache = slot->next;
+		metrics_add(METRIC_POOL_HITS, 1);
+	} else {
+		if (!(slot = malloc(sizeof(struct msg_slot))))
+			return NULL;
+		metrics_add(METRIC_POOL_MISSES, 1);
+	}
+
+	slot->info.msg = slot->buf;
+	return &slot->info;
+}
+
+/*
+ * Returns a message allocated with msg_alloc() to the pool.
+ */
+void msg_free(struct msg_info *msg)
+{
+	struct msg_slot *slot = (struct msg_slot*) msg;
+
+	metrics_add(METRIC_POOL_FREES, 1);
+
+	if (allocator) {
+		slot->next = cache;
+		cache = slot;
+		return;
+	}
+
+	slot->next = atomic_load_explicit(&shared, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&shared, &slot->next,
+				slot, memory_order_release,
+				memory_order_relaxed))
+		;
+}
+
+/*
+ * Gets the pool counters, for sizing.  These are summed over every thread, so
+ * this is not for hot paths.
+ */
+void msg_pool_stats(struct msg_pool_stats *stats)
+{
+	struct metrics m;
+
+	metrics_snapshot(&m);
+	stats->hits   = m.counters[METRIC_POOL_HITS];
+	stats->misses = m.counters[METRIC_POOL_MISSES];
+	stats->frees  = m.counters[METRIC_POOL_FREES];
+}
@@ -0,0 +1,33 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _MSGPOOL_H
+#define _MSGPOOL_H
+
+#include "server.h"
+
+struct msg_pool_stats {
+	unsigned long hits;        // allocations served from a pool
+	unsigned long misses;      // allocations which fell back to malloc
+	unsigned long frees;       // messages returned to a pool
+};
+
+struct msg_info *msg_alloc(void);
+void msg_free(struct msg_info *msg);
+void msg_pool_stats(struct msg_pool_stats *stats);
+
+#endif
@@ -0,0 +1,105 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* netscan.c
+ *
+ * This file implements a batch decoder for a buffer of netstrings, such as
+ * the contents of a netstring_reader or a log file read into memory.  Since
+ * the payload of a netstring is skipped using its length, the work per frame
+ * is in the length prefix, which is parsed a byte at a time: prefixes are a
+ * digit or two in practice, and SSE2 and AVX2 versions of the prefix parser
+ * measured slower than this loop for every prefix length that occurs.
+ */
+
+#include <stdint.h>
+#include <errno.h>
+
+#include "network.h"
+#include "netscan.h"
+
+/*
+ * Parses the length prefix at `p'.  Returns 1 and sets `*hdr' (the length of
+ * the prefix including the colon) and `*size' if the prefix is complete, 0 if
+ * more input is needed, or -1 if the prefix is malformed or the length is
+ * over NETSTRING_MAX_FRAME.
+ */
+static int parse_header(const char *p, size_t avail, size_t *hdr,
+		size_t *size)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < avail && p[i] != ':'; i++) {
+		if (p[i] < '0' || p[i] > '9')
+			return -1;
+		/* a leading zero is only allowed in "0:" */
+		if (i == 1 && p[0] == '0')
+			return -1;
+		/* bounding the size each digit also rules out overflow */
+		n = n * 10 + (p[i] - '0');
+		if (n > NETSTRING_MAX_FRAME)
+			return -1;
+	}
+	if (i == avail)
+		return 0;
+	if (i == 0)
+		return -1;
+
+	*hdr = i + 1;
+	*size = n;
+	return 1;
+}
+
+/*
+ * Locates up to `max' complete netstrings at the start of `buf' and stores
+ * the offset and length of each payload in `frames'.  `*used' is set to the
+ * number of bytes taken up by those frames; an incomplete frame at the end of
+ * the buffer is left for the next call.  Returns the number of frames, or
+ * -EBADMSG if the first frame is malformed.  A malformed frame after a valid
+ * one ends the batch and is reported by the next call.
+ *
+ * Frames are accepted exactly as netstring_read() accepts them, except that
+ * an empty netstring is returned as a frame of length 0 rather than treated
+ * as the end of the stream.
+ */
+ssize_t netstring_scan(const char *buf, size_t len,
+		struct netstring_frame *frames, size_t max, size_t *used)
+{
+	size_t off = 0, n = 0, hdr, size;
+	int rc;
+
+	while (n < max && off < len) {
+		rc = parse_header(buf + off, len - off, &hdr, &size);
+		if (rc == 0)
+			break;
+		if (rc < 0)
+			goto bad;
+		if (len - off - hdr <= size)
+			break;
+		if (buf[off + hdr + size] != ',')
+			goto bad;
+
+		frames[n].off = off + hdr;
+		frames[n].len = size;
+		n++;
+		off += hdr + size + 1;
+	}
+	*used = off;
+	return n;
+bad:
+	*used = off;
+	return n ? (ssize_t) n : -EBADMSG;
+}
@@ -0,0 +1,32 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _NETSCAN_H
+#define _NETSCAN_H
+
+#include <unistd.h>     /* ssize_t */
+
+/* a frame located by netstring_scan() */
+struct netstring_frame {
+	size_t off;                // offset of the payload in the buffer
+	size_t len;                // length of the payload
+};
+
+ssize_t netstring_scan(const char *buf, size_t len,
+		struct netstring_frame *frames, size_t max, size_t *used);
+
+#endif
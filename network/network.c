@@ -15,23 +15,36 @@
  * this program.  If not, see <http://www.gnu.org/licenses/>
  */
 
+#define _GNU_SOURCE /* sendmmsg */
+
 /* network.c
  *
  * This file contains some convenient functions for TCP/UDP communication which
  * avoid the short read/short write problem, as well as a function to
  * packetize incoming TCP streams.
+ *
+ * fuzz.c and bench.c are a fuzzer and a benchmark for the framing functions.
  */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
 #include <errno.h>
 
 #include "ipv6.h"
+#include "metrics.h"
+#include "msgbuf.h"
 #include "network.h"
 
 ssize_t tcp_send_bytes(int sock, const char *buf, size_t len)
@@ -41,25 +54,56 @@ ssize_t tcp_send_bytes(int sock, const char *buf, size_t len)
 
 	bsent = 0;
 	while (bsent < len) {
+		metrics_add(METRIC_SYSCALLS_OUT, 1);
 		rv = send(sock, buf + bsent, len - bsent, MSG_NOSIGNAL);
 		if (rv == -1)
 			return -errno;
 		bsent += rv;
 	}
+	metrics_add(METRIC_BYTES_OUT, bsent);
 	return bsent;
 }
 
+/*
+ * Formats a message into a new message buffer, for the *sendf() functions.
+ * `size' is only a hint for the initial capacity.  Returns 0 on success, or
+ * a negative error number.
+ */
+static int sendf_format(struct msgbuf *mb, size_t size, const char *fmt,
+		va_list ap)
+{
+	int rc;
+
+	if ((rc = msgbuf_init(mb, size)))
+		return rc;
+	if ((rc = msgbuf_vprintf(mb, fmt, ap)))
+		msgbuf_release(mb);
+	return rc;
+}
+
+/*
+ * Sends the message in a message buffer as raw bytes.
+ */
+ssize_t tcp_send_msgbuf(int sock, struct msgbuf *mb)
+{
+	return tcp_send_bytes(sock, msgbuf_data(mb), mb->len);
+}
+
 ssize_t tcp_sendf(int sock, size_t size, const char *fmt, ...)
 {
-	char buf[size];
-	int len;
+	struct msgbuf mb;
 	va_list ap;
+	ssize_t rc;
 
 	va_start(ap, fmt);
-	len = vsnprintf(buf, size, fmt, ap);
+	rc = sendf_format(&mb, size, fmt, ap);
 	va_end(ap);
+	if (rc)
+		return rc;
 
-	return tcp_send_bytes(sock, buf, len);
+	rc = tcp_send_msgbuf(sock, &mb);
+	msgbuf_release(&mb);
+	return rc;
 }
 
 ssize_t tcp_read_bytes(int sock, char *msg_buf, size_t bytes)
@@ -68,6 +112,7 @@ ssize_t tcp_read_bytes(int sock, char *msg_buf, size_t bytes)
 	size_t bread = 0;
 
 	while (bread < bytes) {
+		metrics_add(METRIC_SYSCALLS_IN, 1);
 		rv = recv(sock, msg_buf + bread, bytes - bread, 0);
 		if (rv == -1)
 			return -errno;
@@ -75,44 +120,54 @@ ssize_t tcp_read_bytes(int sock, char *msg_buf, size_t bytes)
 			break;
 		bread += rv;
 	}
+	metrics_add(METRIC_BYTES_IN, bread);
 	return bread;
 }
 
 #define NETSTRING_MAX_DIGITS 100
 
+#define VARINT_MAX_BYTES     10 /* a 64-bit LEB128 varint */
+#define VARINT_MAX_HEADER    (1 + 2 * VARINT_MAX_BYTES)
+
+/* largest datagram that is batched; larger ones are sent immediately */
+#define UDP_SENDER_MSG_MAX   1472
+
+/* below this, pinning pages costs more than copying them */
+#define ZEROCOPY_THRESHOLD   (64 * 1024)
+
+static size_t zerocopy_threshold = ZEROCOPY_THRESHOLD;
+
+/*
+ * Advances a msghdr past `amnt' bytes that have been transferred.  Buffers
+ * transferred completely are dropped, and the first remaining one is trimmed.
+ */
 static void shift_msghdr(struct msghdr *hdr, size_t amnt)
 {
-	size_t i, off;
-	int tmp = amnt;
-
-	for (i = 0; tmp > 0 && i < hdr->msg_iovlen; i++)
-		tmp -= hdr->msg_iov[i].iov_len;
+	size_t i;
 
-	/* exactly on iov boundary */
-	if (tmp == 0) {
-		hdr->msg_iov = &hdr->msg_iov[i];
-		hdr->msg_iovlen -= i;
-		return;
-	}
+	for (i = 0; i < hdr->msg_iovlen && amnt >= hdr->msg_iov[i].iov_len; i++)
+		amnt -= hdr->msg_iov[i].iov_len;
 
-	hdr->msg_iov = &hdr->msg_iov[i-1];
-	hdr->msg_iovlen -= i-1;
+	hdr->msg_iov = &hdr->msg_iov[i];
+	hdr->msg_iovlen -= i;
 
-	off = hdr->msg_iov->iov_len + tmp;
-	hdr->msg_iov->iov_base += off;
-	hdr->msg_iov->iov_len -= off;
+	if (amnt) {
+		hdr->msg_iov->iov_base = (char*) hdr->msg_iov->iov_base + amnt;
+		hdr->msg_iov->iov_len -= amnt;
+	}
 }
 
 ssize_t tcp_send_vector(int sock, struct iovec *vec, size_t len)
 {
 	ssize_t rv;
-	size_t bsent, total = 0;
+	size_t bsent = 0, total = 0;
 	struct msghdr hdr = { .msg_iov = vec, .msg_iovlen = len };
 
 	for (size_t i = 0; i < len; i++)
 		total += vec[i].iov_len;
 
 	for (;;) {
+		metrics_add(METRIC_SYSCALLS_OUT, 1);
 		rv = sendmsg(sock, &hdr, MSG_NOSIGNAL);
 		if (rv == -1)
 			return -errno;
@@ -122,6 +177,237 @@ ssize_t tcp_send_vector(int sock, struct iovec *vec, size_t len)
 		else
 			break;
 	}
+	metrics_add(METRIC_BYTES_OUT, bsent);
+	return bsent;
+}
+
+/*
+ * Prepares a non-blocking transfer of the `len' buffers in `vec'.
+ */
+void tcp_io_init(struct tcp_io *io, struct iovec *vec, size_t len)
+{
+	memset(&io->hdr, 0, sizeof(io->hdr));
+	io->hdr.msg_iov = vec;
+	io->hdr.msg_iovlen = len;
+	io->done = 0;
+	io->total = 0;
+	for (size_t i = 0; i < len; i++)
+		io->total += vec[i].iov_len;
+}
+
+/*
+ * Prepares a non-blocking transfer of a single buffer.
+ */
+void tcp_io_buf(struct tcp_io *io, void *buf, size_t len)
+{
+	io->one.iov_base = buf;
+	io->one.iov_len = len;
+	tcp_io_init(io, &io->one, 1);
+}
+
+/*
+ * Sends as much of a transfer as the socket takes without blocking.  Returns
+ * the number of bytes still to send (0 once the transfer is complete), or a
+ * negative error number.
+ */
+ssize_t tcp_send_nb(int sock, struct tcp_io *io)
+{
+	ssize_t rv;
+
+	while (io->done < io->total) {
+		metrics_add(METRIC_SYSCALLS_OUT, 1);
+		rv = sendmsg(sock, &io->hdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (rv == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -errno;
+		}
+		metrics_add(METRIC_BYTES_OUT, rv);
+		io->done += rv;
+		if (io->done < io->total)
+			shift_msghdr(&io->hdr, rv);
+	}
+	return io->total - io->done;
+}
+
+/*
+ * Receives as much of a transfer as is available without blocking.  Returns
+ * the number of bytes still to receive (0 once the transfer is complete), or
+ * a negative error number.  If the peer closes the connection first, the
+ * error is -ECONNRESET.
+ */
+ssize_t tcp_recv_nb(int sock, struct tcp_io *io)
+{
+	ssize_t rv;
+
+	while (io->done < io->total) {
+		metrics_add(METRIC_SYSCALLS_IN, 1);
+		rv = recvmsg(sock, &io->hdr, MSG_DONTWAIT);
+		if (rv == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -errno;
+		}
+		if (rv == 0)
+			return -ECONNRESET;
+		metrics_add(METRIC_BYTES_IN, rv);
+		io->done += rv;
+		if (io->done < io->total)
+			shift_msghdr(&io->hdr, rv);
+	}
+	return io->total - io->done;
+}
+
+/*
+ * Sets the size above which tcp_send_zerocopy() avoids copying, or disables
+ * zero-copy sends if `bytes' is 0.
+ */
+void tcp_set_zerocopy_threshold(size_t bytes)
+{
+	zerocopy_threshold = bytes ? bytes : SIZE_MAX;
+}
+
+/*
+ * Reads zero-copy completion notifications from the error queue of `sock'
+ * until none of the `*pending' sends is outstanding, waiting for them if
+ * `wait' is set.  Returns 0 on success, or a negative error number.
+ */
+static int zerocopy_reap(int sock, unsigned int *pending, int wait)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+	struct pollfd pfd = { .fd = sock, .events = 0 };
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *err;
+	unsigned int n;
+
+	while (*pending) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		metrics_add(METRIC_SYSCALLS_IN, 1);
+		if (recvmsg(sock, &msg, MSG_ERRQUEUE) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -errno;
+			if (!wait)
+				return 0;
+			/* a pending error is always reported as POLLERR */
+			if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+				return -errno;
+			continue;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+					&& !(cm->cmsg_level == SOL_IPV6
+						&& cm->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			err = (struct sock_extended_err*) CMSG_DATA(cm);
+			if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			if (err->ee_errno)
+				return -err->ee_errno;
+
+			/* notifications cover a range of sends: [ee_info, ee_data] */
+			n = err->ee_data - err->ee_info + 1;
+			*pending -= n < *pending ? n : *pending;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Sends an iovec like tcp_send_vector(), but if it is larger than the
+ * zero-copy threshold the kernel sends straight from the user's pages
+ * (MSG_ZEROCOPY) instead of copying them.  The call returns once the kernel
+ * has released the pages, so the buffers may be reused immediately.  Falls
+ * back to an ordinary send if the socket does not support zero-copy.
+ * Returns the number of bytes sent, or a negative error number.
+ */
+ssize_t tcp_send_zerocopy(int sock, struct iovec *vec, size_t len)
+{
+	struct msghdr hdr = { .msg_iov = vec, .msg_iovlen = len };
+	size_t bsent = 0, total = 0;
+	unsigned int pending = 0;
+	int one = 1, rc;
+	ssize_t rv;
+
+	for (size_t i = 0; i < len; i++)
+		total += vec[i].iov_len;
+
+	if (total < zerocopy_threshold || setsockopt(sock, SOL_SOCKET,
+				SO_ZEROCOPY, &one, sizeof(one)) == -1)
+		return tcp_send_vector(sock, vec, len);
+
+	while (bsent < total) {
+		metrics_add(METRIC_SYSCALLS_OUT, 1);
+		rv = sendmsg(sock, &hdr, MSG_NOSIGNAL | MSG_ZEROCOPY);
+		if (rv == -1) {
+			if (errno == EINTR)
+				continue;
+			/* out of pinned memory: let earlier sends complete */
+			if (errno == ENOBUFS && pending) {
+				if ((rc = zerocopy_reap(sock, &pending, 1)))
+					return rc;
+				continue;
+			}
+			if (errno == ENOBUFS) {
+				rv = tcp_send_vector(sock, hdr.msg_iov,
+						hdr.msg_iovlen);
+				if (rv < 0)
+					return rv;
+				bsent += rv;
+				break;
+			}
+			rc = -errno;
+			zerocopy_reap(sock, &pending, 1);
+			return rc;
+		}
+		pending++;
+		bsent += rv;
+		if (bsent < total)
+			shift_msghdr(&hdr, rv);
+		zerocopy_reap(sock, &pending, 0);
+	}
+
+	if ((rc = zerocopy_reap(sock, &pending, 1)))
+		return rc;
+
+	metrics_add(METRIC_BYTES_OUT, bsent);
+	return bsent;
+}
+
+/*
+ * Sends `size' bytes of the file `fd', starting at `offset', without copying
+ * them through user space.  Returns the number of bytes sent, or a negative
+ * error number.
+ */
+ssize_t tcp_send_file(int sock, int fd, off_t offset, size_t size)
+{
+	size_t bsent = 0;
+	ssize_t rv;
+
+	while (bsent < size) {
+		metrics_add(METRIC_SYSCALLS_OUT, 1);
+		rv = sendfile(sock, fd, &offset, size - bsent);
+		if (rv == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (rv == 0)
+			return -EIO; /* file shorter than `size' */
+		bsent += rv;
+	}
+	metrics_add(METRIC_BYTES_OUT, bsent);
 	return bsent;
 }
 
@@ -166,39 +452,104 @@ ssize_t netstring_send(int sock, size_t size, const char *msg)
 	return tcp_send_vector(sock, msg_iov, 3);
 }
 
-ssize_t netstring_sendf(int sock, size_t size, const char *fmt, ...)
+/*
+ * Sends the message in a message buffer as a netstring.  The length prefix is
+ * written into the buffer's headroom and the comma after the message, so the
+ * whole frame goes out with one send() and no copy.
+ */
+ssize_t netstring_send_msgbuf(int sock, struct msgbuf *mb)
 {
-	size_t buf_len = size + NETSTRING_MAX_DIGITS + 2;
-	char buf[buf_len];
+	char digits[NETSTRING_MAX_DIGITS];
 	char *start;
+	int n;
+
+	n = snprintf(digits, NETSTRING_MAX_DIGITS, "%zu:", mb->len);
+	start = msgbuf_data(mb) - n;
+	memcpy(start, digits, n);
+	msgbuf_data(mb)[mb->len] = ',';
+
+	return tcp_send_bytes(sock, start, n + mb->len + 1);
+}
+
+ssize_t netstring_sendf(int sock, size_t size, const char *fmt, ...)
+{
+	struct msgbuf mb;
 	va_list ap;
-	int len, tmp, digits = 1;
+	ssize_t rc;
 
 	va_start(ap, fmt);
-	len = vsnprintf(buf + NETSTRING_MAX_DIGITS + 1, buf_len, fmt, ap);
+	rc = sendf_format(&mb, size, fmt, ap);
 	va_end(ap);
+	if (rc)
+		return rc;
 
-	buf[NETSTRING_MAX_DIGITS + len + 1] = ',';
+	rc = netstring_send_msgbuf(sock, &mb);
+	msgbuf_release(&mb);
+	return rc;
+}
 
-	tmp = len;
-	while ((tmp /= 10) != 0)
-		digits++;
+ssize_t netstring_send_zerocopy(int sock, size_t size, const char *msg)
+{
+	int digits_len;
+	char digits[NETSTRING_MAX_DIGITS];
+	struct iovec msg_iov[] = {
+		[1] = { .iov_base = (void*) msg, .iov_len = size },
+		[2] = { .iov_base = (void*) ",", .iov_len = 1 }
+	};
 
-	start = buf + (NETSTRING_MAX_DIGITS - digits - 1);
-	len += sprintf(start, "%d:", len);
+	digits_len = snprintf(digits, NETSTRING_MAX_DIGITS, "%zu:", size);
 
-	return tcp_send_bytes(sock, start, len+2);
+	msg_iov[0].iov_base = digits;
+	msg_iov[0].iov_len  = digits_len;
+
+	return tcp_send_zerocopy(sock, msg_iov, 3);
+}
+
+/*
+ * Sends `size' bytes of the file `fd', starting at `offset', as a netstring.
+ * The body goes through sendfile(); the length prefix is sent with MSG_MORE
+ * so that it shares a packet with the start of the body.  Returns the number
+ * of bytes sent, or a negative error number.
+ */
+ssize_t netstring_send_file(int sock, int fd, off_t offset, size_t size)
+{
+	char digits[NETSTRING_MAX_DIGITS];
+	int digits_len;
+	ssize_t rv, total;
+
+	digits_len = snprintf(digits, NETSTRING_MAX_DIGITS, "%zu:", size);
+	for (int n = 0; n < digits_len; n += rv) {
+		metrics_add(METRIC_SYSCALLS_OUT, 1);
+		rv = send(sock, digits + n, digits_len - n,
+				MSG_NOSIGNAL | MSG_MORE);
+		if (rv == -1) {
+			if (errno != EINTR)
+				return -errno;
+			rv = 0;
+		}
+	}
+	metrics_add(METRIC_BYTES_OUT, digits_len);
+
+	if ((rv = tcp_send_file(sock, fd, offset, size)) < 0)
+		return rv;
+	total = digits_len + rv;
+
+	if ((rv = tcp_send_bytes(sock, ",", 1)) < 0)
+		return rv;
+	return total + rv;
 }
 
 ssize_t netstring_read(int sock, char **dst)
 {
 	char *data;
 	size_t size = 0;
+	ssize_t n;
 
 	for (int i = 0; i < NETSTRING_MAX_DIGITS; i++) {
 		signed char c;
 		ssize_t rv;
 
+		metrics_add(METRIC_SYSCALLS_IN, 1);
 		rv = recv(sock, &c, 1, 0);
 		if (rv == -1)
 			return -errno;
@@ -208,20 +559,31 @@ ssize_t netstring_read(int sock, char **dst)
 		if (i == 0 && c == '0')
 			return 0;
 
+		metrics_add(METRIC_BYTES_IN, 1);
+
 		if (c == ':')
 			break;
 
 		if (c < '0' || c > '9')
 			return -1;
 
+		/* bounding the size each digit also rules out overflow */
 		size *= 10;
 		size += c - '0';
+		if (size > NETSTRING_MAX_FRAME)
+			return -1;
 	}
 	if (size == 0)
 		return 0;
 
-	data = malloc(size + 1);
-	tcp_read_bytes(sock, data, size + 1);
+	if (!(data = malloc(size + 1)))
+		return -ENOMEM;
+
+	n = tcp_read_bytes(sock, data, size + 1);
+	if (n != (ssize_t) size + 1) {
+		free(data);
+		return n < 0 ? n : -1;
+	}
 
 	if (data[size] != ',') {
 		free(data);
@@ -233,6 +595,619 @@ ssize_t netstring_read(int sock, char **dst)
 	return size;
 }
 
+/*
+ * Encodes `v' as a LEB128 varint.  Returns the number of bytes used (at most
+ * VARINT_MAX_BYTES).
+ */
+static size_t varint_encode(unsigned char *p, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+/*
+ * Decodes a LEB128 varint.  Returns the number of bytes used, 0 if more
+ * input is needed, or -1 if the varint is too long.
+ */
+static int varint_decode(const unsigned char *p, size_t len, uint64_t *v)
+{
+	uint64_t val = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		if (i == VARINT_MAX_BYTES)
+			return -1;
+		val |= (uint64_t) (p[i] & 0x7f) << (7 * i);
+		if (!(p[i] & 0x80)) {
+			*v = val;
+			return i + 1;
+		}
+	}
+	return len < VARINT_MAX_BYTES ? 0 : -1;
+}
+
+/*
+ * Parses the header of the varint frame at the start of `buf'.  Returns 1 if
+ * the header is complete, setting `*hdr' to its length, `*size' to the length
+ * of the payload and `*tag' to the tag (or VARINT_NO_TAG); 0 if more input
+ * is needed; or -1 if the header is malformed.
+ */
+int varint_parse(const char *buf, size_t len, size_t *hdr, size_t *size,
+		int *tag)
+{
+	const unsigned char *p = (const unsigned char*) buf;
+	uint64_t v;
+	size_t off;
+	int n;
+
+	if (!len)
+		return 0;
+	if ((p[0] & ~VARINT_TAGGED) != VARINT_MARKER)
+		return -1;
+
+	if ((n = varint_decode(p + 1, len - 1, &v)) <= 0)
+		return n;
+	if (v > NETSTRING_MAX_FRAME)
+		return -1;
+	*size = v;
+	off = 1 + n;
+
+	*tag = VARINT_NO_TAG;
+	if (p[0] & VARINT_TAGGED) {
+		if ((n = varint_decode(p + off, len - off, &v)) <= 0)
+			return n;
+		if (v > INT_MAX)
+			return -1;
+		*tag = v;
+		off += n;
+	}
+
+	*hdr = off;
+	return 1;
+}
+
+/*
+ * Sends the `len' buffers in `vec' as one varint frame, with a tag unless
+ * `tag' is VARINT_NO_TAG.  Returns the number of bytes sent, or a negative
+ * error number.
+ */
+ssize_t varint_send_tagged(int sock, int tag, struct iovec *vec, size_t len)
+{
+	struct iovec msg_iov[len+1];
+	unsigned char hdr[VARINT_MAX_HEADER];
+	size_t n = 1, total = 0;
+
+	for (size_t i = 0; i < len; i++)
+		total += vec[i].iov_len;
+
+	hdr[0] = VARINT_MARKER;
+	n += varint_encode(hdr + n, total);
+	if (tag >= 0) {
+		hdr[0] |= VARINT_TAGGED;
+		n += varint_encode(hdr + n, tag);
+	}
+
+	msg_iov[0].iov_base = hdr;
+	msg_iov[0].iov_len  = n;
+
+	for (size_t i = 0; i < len; i++)
+		msg_iov[i+1] = vec[i];
+
+	return tcp_send_vector(sock, msg_iov, len+1);
+}
+
+ssize_t varint_send_vector(int sock, struct iovec *vec, size_t len)
+{
+	return varint_send_tagged(sock, VARINT_NO_TAG, vec, len);
+}
+
+ssize_t varint_send(int sock, size_t size, const char *msg)
+{
+	struct iovec iov = { .iov_base = (void*) msg, .iov_len = size };
+
+	return varint_send_tagged(sock, VARINT_NO_TAG, &iov, 1);
+}
+
+/*
+ * Sends the message in a message buffer as an untagged varint frame, with the
+ * header written into the buffer's headroom.
+ */
+ssize_t varint_send_msgbuf(int sock, struct msgbuf *mb)
+{
+	unsigned char hdr[VARINT_MAX_HEADER];
+	char *start;
+	size_t n;
+
+	hdr[0] = VARINT_MARKER;
+	n = 1 + varint_encode(hdr + 1, mb->len);
+	start = msgbuf_data(mb) - n;
+	memcpy(start, hdr, n);
+
+	return tcp_send_bytes(sock, start, n + mb->len);
+}
+
+ssize_t varint_sendf(int sock, size_t size, const char *fmt, ...)
+{
+	struct msgbuf mb;
+	va_list ap;
+	ssize_t rc;
+
+	va_start(ap, fmt);
+	rc = sendf_format(&mb, size, fmt, ap);
+	va_end(ap);
+	if (rc)
+		return rc;
+
+	rc = varint_send_msgbuf(sock, &mb);
+	msgbuf_release(&mb);
+	return rc;
+}
+
+/*
+ * Reads a varint frame into a newly allocated, NUL-terminated buffer and
+ * stores its tag (or VARINT_NO_TAG) in `*tag' if `tag' is not NULL.  The
+ * shortest possible header is read at once, so a small untagged frame costs
+ * two reads.  Returns the length of the message, 0 on end of stream, or a
+ * negative error number (-1 if the frame is malformed).  As with
+ * netstring_read(), an empty message cannot be told from end of stream.
+ */
+ssize_t varint_read_tagged(int sock, char **dst, int *tag)
+{
+	char hdr[VARINT_MAX_HEADER];
+	size_t len = 2, hlen, size;
+	ssize_t n;
+	int rc, t;
+	char *data;
+
+	/* the shortest header: a marker and a one-byte length */
+	if ((n = tcp_read_bytes(sock, hdr, len)) <= 0)
+		return n;
+	if (n < (ssize_t) len)
+		return -1;
+
+	while (!(rc = varint_parse(hdr, len, &hlen, &size, &t))) {
+		if (len == VARINT_MAX_HEADER)
+			return -1;
+		if ((n = tcp_read_bytes(sock, hdr + len, 1)) <= 0)
+			return n < 0 ? n : -1;
+		len++;
+	}
+	if (rc < 0)
+		return -1;
+	if (size == 0)
+		return 0;
+
+	if (!(data = malloc(size + 1)))
+		return -ENOMEM;
+
+	n = tcp_read_bytes(sock, data, size);
+	if (n != (ssize_t) size) {
+		free(data);
+		return n < 0 ? n : -1;
+	}
+
+	data[size] = '\0';
+	*dst = data;
+	if (tag)
+		*tag = t;
+	return size;
+}
+
+ssize_t varint_read(int sock, char **dst)
+{
+	return varint_read_tagged(sock, dst, NULL);
+}
+
+/*
+ * Reads a frame in either format, telling them apart by the first byte: a
+ * digit starts a netstring and VARINT_MARKER a varint frame.  This costs an
+ * extra (peeking) read per frame, so it is meant for servers migrating from
+ * one format to the other.  Returns as netstring_read().
+ */
+ssize_t frame_read(int sock, char **dst)
+{
+	unsigned char c;
+	ssize_t n;
+
+	do {
+		metrics_add(METRIC_SYSCALLS_IN, 1);
+		n = recv(sock, &c, 1, MSG_PEEK);
+	} while (n == -1 && errno == EINTR);
+	if (n == -1)
+		return -errno;
+	if (n == 0)
+		return 0;
+
+	if ((c & ~VARINT_TAGGED) == VARINT_MARKER)
+		return varint_read(sock, dst);
+	return netstring_read(sock, dst);
+}
+
+/*
+ * Parses the netstring at the start of `buf'.  Returns 1 if it is complete,
+ * 0 if more input is needed, or -1 if it is malformed.  Once the length
+ * prefix has been read, `*hdr' is set to the length of the prefix (including
+ * the colon) and `*size' to the length of the payload.
+ */
+static int netstring_parse(const char *buf, size_t len, size_t *hdr,
+		size_t *size)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < len && buf[i] != ':'; i++) {
+		if (buf[i] < '0' || buf[i] > '9' || i >= NETSTRING_MAX_DIGITS)
+			return -1;
+		/* a leading zero is only allowed in "0:" */
+		if (i == 1 && buf[0] == '0')
+			return -1;
+		if (n > (SIZE_MAX - 10) / 10)
+			return -1;
+		n = n * 10 + (buf[i] - '0');
+	}
+	if (i == len)
+		return 0;
+	if (i == 0)
+		return -1;
+
+	*hdr = i + 1;
+	*size = n;
+	if (len - *hdr <= n)
+		return 0;
+	return buf[*hdr + n] == ',' ? 1 : -1;
+}
+
+/*
+ * Initializes a reader for `sock' with an initial buffer of `size' bytes.
+ * The buffer grows as needed for frames of up to NETSTRING_MAX_FRAME bytes;
+ * `max_size' may be changed after initialization.  Returns 0 on success, or
+ * a negative error number.
+ */
+int netstring_reader_init(struct netstring_reader *r, int sock, size_t size)
+{
+	if (!(r->buf = malloc(size)))
+		return -ENOMEM;
+	r->sock = sock;
+	r->size = size;
+	r->start = 0;
+	r->end = 0;
+	r->max_size = NETSTRING_MAX_FRAME;
+	return 0;
+}
+
+void netstring_reader_destroy(struct netstring_reader *r)
+{
+	free(r->buf);
+	r->buf = NULL;
+}
+
+/*
+ * Reads more input into the buffer, making sure there is room for at least
+ * `need' bytes of unparsed input.  Returns the number of bytes read, 0 on end
+ * of stream, or a negative error number.
+ */
+static ssize_t netstring_reader_fill(struct netstring_reader *r, size_t need)
+{
+	size_t buffered = r->end - r->start;
+	ssize_t rv;
+	char *tmp;
+
+	if (r->size - r->start < need || r->end == r->size) {
+		memmove(r->buf, r->buf + r->start, buffered);
+		r->start = 0;
+		r->end = buffered;
+	}
+	if (r->size < need) {
+		if (need < r->size * 2)
+			need = r->size * 2;
+		if (!(tmp = realloc(r->buf, need)))
+			return -ENOMEM;
+		r->buf = tmp;
+		r->size = need;
+	}
+
+	do {
+		metrics_add(METRIC_SYSCALLS_IN, 1);
+		rv = recv(r->sock, r->buf + r->end, r->size - r->end, 0);
+	} while (rv == -1 && errno == EINTR);
+	if (rv == -1)
+		return -errno;
+
+	metrics_add(METRIC_BYTES_IN, rv);
+	r->end += rv;
+	return rv;
+}
+
+/*
+ * Returns the next frame in the buffer.  If no complete frame is buffered,
+ * reads from the socket if `fill' is set, and returns -EAGAIN otherwise.  The
+ * payload is NUL-terminated in place (over the trailing comma).  As with
+ * netstring_read(), an empty netstring ends the stream; it is left in the
+ * buffer, so every later call returns 0 as well.
+ */
+static ssize_t netstring_reader_next(struct netstring_reader *r, char **frame,
+		int fill)
+{
+	size_t hdr = 0, size = 0;
+	ssize_t rv;
+	char *buf;
+
+	for (;;) {
+		buf = r->buf + r->start;
+		rv = netstring_parse(buf, r->end - r->start, &hdr, &size);
+		if (rv < 0)
+			return -EBADMSG;
+		if (rv > 0)
+			break;
+		if (hdr && size + 1 > r->max_size - hdr)
+			return -EMSGSIZE;
+		if (!fill)
+			return -EAGAIN;
+
+		rv = netstring_reader_fill(r, hdr ? hdr + size + 1
+				: r->end - r->start + 1);
+		if (rv <= 0)
+			return rv;
+	}
+
+	if (size == 0)
+		return 0;
+
+	r->start += hdr + size + 1;
+	buf[hdr + size] = '\0';
+	*frame = buf + hdr;
+	return size;
+}
+
+/*
+ * Reads the next netstring from a buffered reader into a newly allocated,
+ * NUL-terminated buffer.  Returns the length of the message, 0 on end of
+ * stream, or a negative error number.
+ */
+ssize_t netstring_reader_read(struct netstring_reader *r, char **dst)
+{
+	char *frame, *data;
+	ssize_t rv;
+
+	if ((rv = netstring_reader_next(r, &frame, 1)) <= 0)
+		return rv;
+
+	if (!(data = malloc(rv + 1)))
+		return -ENOMEM;
+	memcpy(data, frame, rv + 1);
+	*dst = data;
+	return rv;
+}
+
+/*
+ * Reads the next netstring from a buffered reader without copying it: `view'
+ * points into the reader's buffer and is valid until the next call on the
+ * reader.  Returns the length of the message, 0 on end of stream, or a
+ * negative error number.
+ */
+ssize_t netstring_reader_view(struct netstring_reader *r,
+		struct netstring_view *view)
+{
+	ssize_t rv;
+
+	if ((rv = netstring_reader_next(r, &view->data, 1)) <= 0)
+		return rv;
+	view->len = rv;
+	return rv;
+}
+
+/*
+ * Returns up to `max' frames as views into the reader's buffer.  The socket is
+ * only read while the first frame is incomplete (as often as that takes, for a
+ * frame larger than one recv() returns); the rest of the batch is whatever
+ * else is already buffered.  All of the views stay valid until the next call
+ * on the reader, so a whole batch can be processed without copying or
+ * allocating.  Returns the number of frames,
+ * 0 on end of stream, or a negative error number.  End of stream and errors
+ * that follow a frame are reported by the next call.
+ */
+ssize_t netstring_reader_batch(struct netstring_reader *r,
+		struct netstring_view *views, size_t max)
+{
+	ssize_t rv;
+	size_t n;
+
+	for (n = 0; n < max; n++) {
+		rv = netstring_reader_next(r, &views[n].data, n == 0);
+		if (rv <= 0)
+			return n ? (ssize_t) n : rv;
+		views[n].len = rv;
+	}
+	return n;
+}
+
+static uint64_t clock_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Initializes a write buffer of `size' bytes for `sock'.  By default the
+ * buffer is flushed only when full; the thresholds may be changed after
+ * initialization.  Returns 0 on success, or a negative error number.
+ */
+int tcp_cork_init(struct tcp_cork *c, int sock, size_t size)
+{
+	if (!(c->buf = malloc(size)))
+		return -ENOMEM;
+	c->sock = sock;
+	c->size = size;
+	c->len = 0;
+	c->count = 0;
+	c->max_bytes = size;
+	c->max_count = 0;
+	c->max_delay = 0;
+	return 0;
+}
+
+/*
+ * Frees a write buffer.  Buffered output is discarded; call tcp_cork_flush()
+ * first to send it.
+ */
+void tcp_cork_destroy(struct tcp_cork *c)
+{
+	free(c->buf);
+	c->buf = NULL;
+}
+
+/*
+ * Writes the buffered output followed by `vec' with one writev().  Returns 0
+ * on success, or a negative error number.
+ */
+static ssize_t tcp_cork_write(struct tcp_cork *c, struct iovec *vec,
+		size_t len)
+{
+	struct iovec iov[len+1];
+	size_t n = 0;
+	ssize_t rv;
+
+	if (c->len) {
+		iov[n].iov_base = c->buf;
+		iov[n++].iov_len = c->len;
+	}
+	for (size_t i = 0; i < len; i++)
+		iov[n++] = vec[i];
+	if (!n)
+		return 0;
+
+	c->len = 0;
+	c->count = 0;
+	rv = tcp_send_vector(c->sock, iov, n);
+	return rv < 0 ? rv : 0;
+}
+
+/*
+ * Sends all buffered output.  Returns 0 on success, or a negative error
+ * number.
+ */
+ssize_t tcp_cork_flush(struct tcp_cork *c)
+{
+	return tcp_cork_write(c, NULL, 0);
+}
+
+/*
+ * Appends output, given as an iovec of `len' elements.  Output too large to
+ * buffer is written directly, together with the buffered output, rather than
+ * copied.  Returns the number of bytes appended, or a negative error number.
+ */
+ssize_t tcp_cork_vector(struct tcp_cork *c, struct iovec *vec, size_t len)
+{
+	size_t total = 0;
+	ssize_t rv;
+
+	for (size_t i = 0; i < len; i++)
+		total += vec[i].iov_len;
+
+	if (total > c->size - c->len) {
+		if (total >= c->size / 2) {
+			rv = tcp_cork_write(c, vec, len);
+			return rv < 0 ? rv : (ssize_t) total;
+		}
+		if ((rv = tcp_cork_flush(c)) < 0)
+			return rv;
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		memcpy(c->buf + c->len, vec[i].iov_base, vec[i].iov_len);
+		c->len += vec[i].iov_len;
+	}
+
+	if (!c->count++ && c->max_delay)
+		c->first = clock_ms();
+
+	if ((c->max_bytes && c->len >= c->max_bytes)
+			|| (c->max_count && c->count >= c->max_count)
+			|| (c->max_delay && clock_ms() - c->first >= c->max_delay)) {
+		if ((rv = tcp_cork_flush(c)) < 0)
+			return rv;
+	}
+	return total;
+}
+
+ssize_t tcp_cork_bytes(struct tcp_cork *c, const char *buf, size_t len)
+{
+	struct iovec iov = { .iov_base = (void*) buf, .iov_len = len };
+
+	return tcp_cork_vector(c, &iov, 1);
+}
+
+ssize_t tcp_cork_sendf(struct tcp_cork *c, size_t size, const char *fmt, ...)
+{
+	struct msgbuf mb;
+	va_list ap;
+	ssize_t rc;
+
+	va_start(ap, fmt);
+	rc = sendf_format(&mb, size, fmt, ap);
+	va_end(ap);
+	if (rc)
+		return rc;
+
+	rc = tcp_cork_bytes(c, msgbuf_data(&mb), mb.len);
+	msgbuf_release(&mb);
+	return rc;
+}
+
+ssize_t tcp_cork_netstring_vector(struct tcp_cork *c, struct iovec *vec,
+		size_t len)
+{
+	struct iovec msg_iov[len+2];
+	char digits[NETSTRING_MAX_DIGITS];
+	size_t total = 0;
+
+	for (size_t i = 0; i < len; i++)
+		total += vec[i].iov_len;
+
+	msg_iov[0].iov_base = digits;
+	msg_iov[0].iov_len = snprintf(digits, NETSTRING_MAX_DIGITS, "%zu:",
+			total);
+
+	for (size_t i = 0; i < len; i++)
+		msg_iov[i+1] = vec[i];
+
+	msg_iov[len+1].iov_base = ",";
+	msg_iov[len+1].iov_len  = 1;
+
+	return tcp_cork_vector(c, msg_iov, len+2);
+}
+
+ssize_t tcp_cork_netstring(struct tcp_cork *c, size_t size, const char *msg)
+{
+	struct iovec iov = { .iov_base = (void*) msg, .iov_len = size };
+
+	return tcp_cork_netstring_vector(c, &iov, 1);
+}
+
+ssize_t tcp_cork_netstring_sendf(struct tcp_cork *c, size_t size,
+		const char *fmt, ...)
+{
+	struct msgbuf mb;
+	va_list ap;
+	ssize_t rc;
+
+	va_start(ap, fmt);
+	rc = sendf_format(&mb, size, fmt, ap);
+	va_end(ap);
+	if (rc)
+		return rc;
+
+	rc = tcp_cork_netstring(c, mb.len, msgbuf_data(&mb));
+	msgbuf_release(&mb);
+	return rc;
+}
+
 int udp_send(const struct sockaddr *addr, size_t len, const char *msg)
 {
 	int sock, rc;
@@ -242,23 +1217,269 @@ int udp_send(const struct sockaddr *addr, size_t len, const char *msg)
 	if (sock == -1)
 		return -errno;
 
+	/* socket(), sendto() and close() */
+	metrics_add(METRIC_SYSCALLS_OUT, 3);
 	rc = sendto(sock, msg, len, 0, addr, sin_size);
 	if (rc == -1)
 		rc = -errno;
+	else
+		metrics_add(METRIC_BYTES_OUT, rc);
 
 	close(sock);
 	return rc;
 }
 
+int udp_send_msgbuf(const struct sockaddr *addr, struct msgbuf *mb)
+{
+	return udp_send(addr, mb->len, msgbuf_data(mb));
+}
+
 int udp_sendf(const struct sockaddr *addr, size_t size, const char *fmt, ...)
 {
-	char msg[size];
-	int len;
+	struct msgbuf mb;
+	va_list ap;
+	int rc;
+
+	va_start(ap, fmt);
+	rc = sendf_format(&mb, size, fmt, ap);
+	va_end(ap);
+	if (rc)
+		return rc;
+
+	rc = udp_send_msgbuf(addr, &mb);
+	msgbuf_release(&mb);
+	return rc;
+}
+
+/*
+ * Initializes a UDP sender.  If `sock' is not -1, datagrams are sent from it;
+ * otherwise up to `max_dests' connected sockets are cached.  Up to
+ * `batch_size' datagrams may be queued before they are flushed.  Returns 0 on
+ * success, or a negative error number.
+ */
+int udp_sender_init(struct udp_sender *s, int sock, unsigned int max_dests,
+		unsigned int batch_size)
+{
+	s->sock = sock;
+	s->fam_sock[0] = s->fam_sock[1] = -1;
+	s->nr_dests = 0;
+	s->max_dests = max_dests ? max_dests : 1;
+	s->clock = 0;
+	s->nr_queued = 0;
+	s->batch_size = batch_size ? batch_size : 1;
+
+	s->dests   = calloc(s->max_dests, sizeof(struct udp_dest));
+	s->tx      = calloc(s->batch_size, sizeof(struct mmsghdr));
+	s->tx_iov  = calloc(s->batch_size, sizeof(struct iovec));
+	s->tx_addr = calloc(s->batch_size, sizeof(struct sockaddr_storage));
+	s->tx_bufs = malloc((size_t) s->batch_size * UDP_SENDER_MSG_MAX);
+
+	if (!s->dests || !s->tx || !s->tx_iov || !s->tx_addr || !s->tx_bufs) {
+		udp_sender_destroy(s);
+		return -ENOMEM;
+	}
+
+	for (unsigned int i = 0; i < s->batch_size; i++) {
+		s->tx_iov[i].iov_base = s->tx_bufs + (size_t) i * UDP_SENDER_MSG_MAX;
+		s->tx[i].msg_hdr.msg_iov = &s->tx_iov[i];
+		s->tx[i].msg_hdr.msg_iovlen = 1;
+		s->tx[i].msg_hdr.msg_name = &s->tx_addr[i];
+	}
+	return 0;
+}
+
+/*
+ * Frees a UDP sender and closes the sockets it created.  Queued datagrams are
+ * discarded; call udp_sender_flush() first to send them.
+ */
+void udp_sender_destroy(struct udp_sender *s)
+{
+	for (unsigned int i = 0; i < s->nr_dests; i++)
+		close(s->dests[i].sock);
+	for (int i = 0; i < 2; i++) {
+		if (s->fam_sock[i] != -1)
+			close(s->fam_sock[i]);
+	}
+	free(s->dests);
+	free(s->tx);
+	free(s->tx_iov);
+	free(s->tx_addr);
+	free(s->tx_bufs);
+	s->dests = NULL;
+	s->tx = NULL;
+	s->tx_iov = NULL;
+	s->tx_addr = NULL;
+	s->tx_bufs = NULL;
+	s->nr_dests = 0;
+}
+
+/*
+ * Returns a socket connected to `addr', from the cache if possible.  When
+ * the cache is full, the least recently used destination is evicted.
+ * Returns a negative error number on failure.
+ */
+static int udp_sender_dest(struct udp_sender *s, const struct sockaddr *addr)
+{
+	struct udp_dest *dest = NULL;
+	int sock;
+
+	for (unsigned int i = 0; i < s->nr_dests; i++) {
+		if (sockaddr_equals((struct sockaddr*) &s->dests[i].addr, addr)) {
+			s->dests[i].used = ++s->clock;
+			return s->dests[i].sock;
+		}
+		if (!dest || s->dests[i].used < dest->used)
+			dest = &s->dests[i];
+	}
+
+	metrics_add(METRIC_SYSCALLS_OUT, 2);
+	sock = socket(addr->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (sock == -1)
+		return -errno;
+	if (connect(sock, addr, get_sockaddr_size(addr)) == -1) {
+		close(sock);
+		return -errno;
+	}
+
+	if (s->nr_dests < s->max_dests)
+		dest = &s->dests[s->nr_dests++];
+	else
+		close(dest->sock);
+
+	memcpy(&dest->addr, addr, get_sockaddr_size(addr));
+	dest->sock = sock;
+	dest->used = ++s->clock;
+	return sock;
+}
+
+/*
+ * Returns the socket queued datagrams to `addr' are sent from.
+ */
+static int udp_sender_batch_sock(struct udp_sender *s, int family)
+{
+	int *sock = &s->fam_sock[family == AF_INET6];
+
+	if (s->sock != -1)
+		return s->sock;
+	if (*sock == -1)
+		*sock = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	return *sock;
+}
+
+/*
+ * Sends a datagram to `addr'.  Returns the number of bytes sent, or a
+ * negative error number.
+ */
+int udp_sender_send(struct udp_sender *s, const struct sockaddr *addr,
+		size_t len, const char *msg)
+{
+	int sock, rc;
+
+	if (s->sock != -1) {
+		metrics_add(METRIC_SYSCALLS_OUT, 1);
+		rc = sendto(s->sock, msg, len, 0, addr, get_sockaddr_size(addr));
+	} else {
+		if ((sock = udp_sender_dest(s, addr)) < 0)
+			return sock;
+		metrics_add(METRIC_SYSCALLS_OUT, 1);
+		rc = send(sock, msg, len, 0);
+		/* reported for an earlier datagram, by an ICMP port unreachable */
+		if (rc == -1 && errno == ECONNREFUSED) {
+			metrics_add(METRIC_SYSCALLS_OUT, 1);
+			rc = send(sock, msg, len, 0);
+		}
+	}
+	if (rc == -1)
+		return -errno;
+
+	metrics_add(METRIC_BYTES_OUT, rc);
+	return rc;
+}
+
+int udp_sender_sendf(struct udp_sender *s, const struct sockaddr *addr,
+		size_t size, const char *fmt, ...)
+{
+	struct msgbuf mb;
 	va_list ap;
+	int rc;
 
 	va_start(ap, fmt);
-	len = vsnprintf(msg, size, fmt, ap);
+	rc = sendf_format(&mb, size, fmt, ap);
 	va_end(ap);
+	if (rc)
+		return rc;
+
+	rc = udp_sender_send(s, addr, mb.len, msgbuf_data(&mb));
+	msgbuf_release(&mb);
+	return rc;
+}
+
+/*
+ * Queues a datagram to `addr'.  The data is copied, so `msg' may be reused
+ * immediately.  The queue is flushed when it is full; datagrams too large to
+ * queue are sent at once, after the queue has been flushed.  Returns 0 on
+ * success, or a negative error number.
+ */
+int udp_sender_queue(struct udp_sender *s, const struct sockaddr *addr,
+		size_t len, const char *msg)
+{
+	unsigned int i;
+	int rc;
+
+	if (len > UDP_SENDER_MSG_MAX) {
+		if ((rc = udp_sender_flush(s)))
+			return rc;
+		rc = udp_sender_send(s, addr, len, msg);
+		return rc < 0 ? rc : 0;
+	}
+
+	if (s->nr_queued == s->batch_size && (rc = udp_sender_flush(s)))
+		return rc;
+
+	i = s->nr_queued++;
+	memcpy(s->tx_iov[i].iov_base, msg, len);
+	s->tx_iov[i].iov_len = len;
+	memcpy(&s->tx_addr[i], addr, get_sockaddr_size(addr));
+	s->tx[i].msg_hdr.msg_namelen = get_sockaddr_size(addr);
+	return 0;
+}
 
-	return udp_send(addr, len, msg);
+/*
+ * Sends every queued datagram, with one sendmmsg() per run of datagrams of
+ * the same address family.  Datagrams that fail are dropped.  Returns 0 on
+ * success, or the last error encountered.
+ */
+int udp_sender_flush(struct udp_sender *s)
+{
+	unsigned int off = 0, end;
+	int family, sock, rc, err = 0;
+
+	while (off < s->nr_queued) {
+		family = s->tx_addr[off].ss_family;
+		for (end = off + 1; end < s->nr_queued
+				&& s->tx_addr[end].ss_family == family; end++)
+			;
+
+		if ((sock = udp_sender_batch_sock(s, family)) == -1) {
+			err = -errno;
+			off = end;
+			continue;
+		}
+
+		metrics_add(METRIC_SYSCALLS_OUT, 1);
+		rc = sendmmsg(sock, s->tx + off, end - off, 0);
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			rc = 1; /* drop the datagram that failed */
+		} else {
+			for (int i = 0; i < rc; i++)
+				metrics_add(METRIC_BYTES_OUT,
+						s->tx[off + i].msg_len);
+		}
+		off += rc;
+	}
+	s->nr_queued = 0;
+	return err;
 }
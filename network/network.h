@@ -18,22 +18,188 @@
 #ifndef _NETWORK_H
 #define _NETWORK_H
 
+#include <stdint.h>
 #include <unistd.h>     /* ssize_t */
 #include <sys/uio.h>    /* iovec */
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+struct msgbuf;
+
 ssize_t tcp_read_bytes(int sock, char *msg_buf, size_t bytes);
 ssize_t tcp_send_bytes(int sock, const char *buf, size_t len);
 ssize_t tcp_send_vector(int sock, struct iovec *vec, size_t len);
 ssize_t tcp_sendf(int sock, size_t size, const char *fmt, ...);
+ssize_t tcp_send_msgbuf(int sock, struct msgbuf *mb);
+
+/*
+ * The progress of a non-blocking transfer.  tcp_send_nb() and tcp_recv_nb()
+ * transfer as much as the socket allows without blocking and record where
+ * they stopped, so the transfer can be resumed on the next readiness event.
+ * The iovec given to tcp_io_init() is modified as the transfer progresses and
+ * must stay valid until it is complete.
+ */
+struct tcp_io {
+	struct msghdr hdr;         // the part of the iovec not yet transferred
+	struct iovec one;          // storage for tcp_io_buf()
+	size_t done;               // bytes transferred
+	size_t total;
+};
+
+void tcp_io_init(struct tcp_io *io, struct iovec *vec, size_t len);
+void tcp_io_buf(struct tcp_io *io, void *buf, size_t len);
+ssize_t tcp_send_nb(int sock, struct tcp_io *io);
+ssize_t tcp_recv_nb(int sock, struct tcp_io *io);
+void tcp_set_zerocopy_threshold(size_t bytes);
+ssize_t tcp_send_zerocopy(int sock, struct iovec *vec, size_t len);
+ssize_t tcp_send_file(int sock, int fd, off_t offset, size_t size);
+
+/*
+ * A buffered reader for a stream of netstrings.  Input is read in large
+ * chunks, and every complete netstring in the buffer is returned before the
+ * socket is read again, so pipelined frames cost one recv() per batch rather
+ * than several per frame.  Partial frames are kept until the rest arrives.
+ * With a non-blocking socket, reads return -EAGAIN once the buffer holds no
+ * complete frame.
+ */
+struct netstring_reader {
+	int sock;
+	char *buf;
+	size_t size;               // capacity of `buf'
+	size_t start;              // first unparsed byte
+	size_t end;                // end of buffered input
+	size_t max_size;           // largest frame accepted
+};
+
+/*
+ * A frame returned in place from a reader's buffer.  `data' is
+ * NUL-terminated.  Views are only valid until the next call on the reader:
+ * once every buffered frame has been returned, the reader reuses (and may
+ * move) its buffer.
+ */
+struct netstring_view {
+	char *data;
+	size_t len;
+};
+
+/* the largest netstring payload any reader accepts */
+#define NETSTRING_MAX_FRAME (16 * 1024 * 1024)
 
 ssize_t netstring_read(int sock, char **dst);
+int netstring_reader_init(struct netstring_reader *r, int sock, size_t size);
+void netstring_reader_destroy(struct netstring_reader *r);
+ssize_t netstring_reader_read(struct netstring_reader *r, char **dst);
+ssize_t netstring_reader_view(struct netstring_reader *r,
+		struct netstring_view *view);
+ssize_t netstring_reader_batch(struct netstring_reader *r,
+		struct netstring_view *views, size_t max);
 ssize_t netstring_send(int sock, size_t size, const char *msg);
 ssize_t netstring_send_vector(int sock, struct iovec *vec, size_t len);
 ssize_t netstring_sendf(int sock, size_t size, const char *fmt, ...);
+ssize_t netstring_send_msgbuf(int sock, struct msgbuf *mb);
+ssize_t netstring_send_zerocopy(int sock, size_t size, const char *msg);
+ssize_t netstring_send_file(int sock, int fd, off_t offset, size_t size);
+
+/*
+ * Binary framing: a marker byte (VARINT_MARKER, or'ed with VARINT_TAGGED if a
+ * tag follows), the payload length as a LEB128 varint, an optional tag as a
+ * second varint, then the payload.  A message under 128 bytes costs two bytes
+ * of framing.  The marker can never start a netstring, so frame_read() can
+ * accept either format on the same connection.
+ */
+#define VARINT_MARKER 0xc0
+#define VARINT_TAGGED 0x01
+#define VARINT_NO_TAG (-1)
+
+ssize_t varint_send(int sock, size_t size, const char *msg);
+ssize_t varint_send_vector(int sock, struct iovec *vec, size_t len);
+ssize_t varint_send_tagged(int sock, int tag, struct iovec *vec, size_t len);
+ssize_t varint_sendf(int sock, size_t size, const char *fmt, ...);
+ssize_t varint_send_msgbuf(int sock, struct msgbuf *mb);
+ssize_t varint_read(int sock, char **dst);
+ssize_t varint_read_tagged(int sock, char **dst, int *tag);
+int varint_parse(const char *buf, size_t len, size_t *hdr, size_t *size,
+		int *tag);
+ssize_t frame_read(int sock, char **dst);
+/*
+ * A write buffer that coalesces many small sends on a connection into one
+ * system call.  Output is appended to the buffer and written with a single
+ * writev() once `max_bytes' bytes or `max_count' sends are buffered, once the
+ * oldest buffered send is `max_delay' ms old, or when tcp_cork_flush() is
+ * called.  A limit of 0 is disabled.  The delay is only checked when output
+ * is appended, so callers must flush before waiting for input.
+ */
+struct tcp_cork {
+	int sock;
+	char *buf;
+	size_t size;               // capacity of `buf'
+	size_t len;                // bytes buffered
+	unsigned int count;        // sends buffered
+	uint64_t first;            // time of the oldest buffered send (ms)
+	size_t max_bytes;
+	unsigned int max_count;
+	unsigned int max_delay;
+};
+
+int tcp_cork_init(struct tcp_cork *c, int sock, size_t size);
+void tcp_cork_destroy(struct tcp_cork *c);
+ssize_t tcp_cork_flush(struct tcp_cork *c);
+ssize_t tcp_cork_bytes(struct tcp_cork *c, const char *buf, size_t len);
+ssize_t tcp_cork_vector(struct tcp_cork *c, struct iovec *vec, size_t len);
+ssize_t tcp_cork_sendf(struct tcp_cork *c, size_t size, const char *fmt, ...);
+ssize_t tcp_cork_netstring(struct tcp_cork *c, size_t size, const char *msg);
+ssize_t tcp_cork_netstring_vector(struct tcp_cork *c, struct iovec *vec,
+		size_t len);
+ssize_t tcp_cork_netstring_sendf(struct tcp_cork *c, size_t size,
+		const char *fmt, ...);
 
 int udp_send(const struct sockaddr *addr, size_t len, const char *msg);
 int udp_sendf(const struct sockaddr *addr, size_t size, const char *fmt, ...);
+int udp_send_msgbuf(const struct sockaddr *addr, struct msgbuf *mb);
+
+/* a destination in a udp_sender's cache */
+struct udp_dest {
+	struct sockaddr_storage addr;
+	int sock;                  // socket connected to `addr'
+	unsigned long used;        // time of last use, for eviction
+};
+
+/*
+ * A reusable UDP sender.  Datagrams sent with udp_sender_send() go through a
+ * socket connected to the destination, kept in a small cache, so that each
+ * datagram costs one send() instead of socket(), sendto() and close().
+ * Datagrams queued with udp_sender_queue() are sent together with one
+ * sendmmsg() by udp_sender_flush().
+ *
+ * If the sender is given a bound socket (e.g. a UDP server's), everything is
+ * sent from that socket instead, so that replies come from the server's
+ * address.
+ */
+struct udp_sender {
+	int sock;                  // bound socket, or -1
+	int fam_sock[2];           // unconnected sockets for queued datagrams
+	struct udp_dest *dests;
+	unsigned int nr_dests;
+	unsigned int max_dests;
+	unsigned long clock;
+
+	unsigned int nr_queued;
+	unsigned int batch_size;
+	struct mmsghdr *tx;
+	struct iovec *tx_iov;
+	struct sockaddr_storage *tx_addr;
+	char *tx_bufs;
+};
+
+int udp_sender_init(struct udp_sender *s, int sock, unsigned int max_dests,
+		unsigned int batch_size);
+void udp_sender_destroy(struct udp_sender *s);
+int udp_sender_send(struct udp_sender *s, const struct sockaddr *addr,
+		size_t len, const char *msg);
+int udp_sender_sendf(struct udp_sender *s, const struct sockaddr *addr,
+		size_t size, const char *fmt, ...);
+int udp_sender_queue(struct udp_sender *s, const struct sockaddr *addr,
+		size_t len, const char *msg);
+int udp_sender_flush(struct udp_sender *s);
 
 #endif
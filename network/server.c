@@ -15,6 +15,8 @@
  * this program.  If not, see <http://www.gnu.org/licenses/>
  */
 
+#define _GNU_SOURCE /* recvmmsg, sendmmsg */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -28,9 +30,19 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <syslog.h>
+#include <time.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <setjmp.h>
 
+#include "ipv6.h"
 #include "network.h"
+#include "mpmc.h"
+#include "metrics.h"
+#include "msgpool.h"
 #include "server.h"
 
 /* server.c
@@ -40,10 +52,72 @@
 
 #define BACKLOG 10
 
-static int num_threads;
-static pthread_mutex_t num_threads_lock;
+static atomic_int num_threads;
 
-int tcp_server_init(char *port)
+/*
+ * Admission control for tcp_server_main().  Connections arriving at the
+ * thread limit wait in `pending' until a handler thread finishes; a handler
+ * picks up the next pending connection instead of exiting.  Connections which
+ * have waited longer than the budget are closed unserved, and if shedding is
+ * enabled so are arrivals whose expected wait (estimated from the measured
+ * handler latency) exceeds the budget.
+ */
+static struct admission_config admission = {
+	.backlog = BACKLOG,
+};
+
+static struct {
+	struct mpmc_queue queue;
+	atomic_int nr;
+	int max_threads;
+	void *(*cb)(void*);
+	atomic_ullong latency;      // moving average of handler time (ns)
+	atomic_ulong shed;          // connections closed unserved
+} pending;
+
+/*
+ * Worker pool for udp_server_pool_main().  The receive loop pushes messages
+ * onto `queue' and posts `items'; workers wait on `items' and pop.
+ */
+static struct {
+	struct mpmc_queue queue;
+	sem_t items;
+	void *(*cb)(void*);
+} pool;
+
+/*
+ * Set in pool workers and TCP handler threads so that service_exit() returns
+ * the thread to its loop instead of terminating it.
+ */
+static _Thread_local jmp_buf *worker_return;
+
+/*
+ * State for udp_server_batch_main(): `size' receive slots filled by each call
+ * to recvmmsg(), and up to `size' queued replies flushed by sendmmsg().
+ */
+struct udp_batch {
+	int sock;
+	unsigned int size;
+
+	struct msg_info *msgs;
+	struct mmsghdr *rx;
+	struct iovec *rx_iov;
+	char *rx_bufs;
+
+	unsigned int nr_replies;
+	struct mmsghdr *tx;
+	struct iovec *tx_iov;
+	struct sockaddr_storage *tx_addr;
+	char *tx_bufs;
+};
+
+/*
+ * Creates a socket of type `socktype' bound to `port' on all interfaces.  If
+ * `reuseport' is set, the socket is bound with SO_REUSEPORT so that several
+ * sockets may share the port, with the kernel spreading connections and
+ * datagrams among them.
+ */
+static int server_bind(char *port, int socktype, int reuseport)
 {
 	struct addrinfo hints, *servinfo, *p;
 	const int yes = 1;
@@ -52,7 +126,7 @@ int tcp_server_init(char *port)
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family   = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_socktype = socktype;
 	hints.ai_flags    = AI_PASSIVE;
 
 	if ((rc = getaddrinfo(NULL, port, &hints, &servinfo))) {
@@ -60,7 +134,6 @@ int tcp_server_init(char *port)
 		exit(EXIT_FAILURE);
 	}
 
-	/* create a socket to listen for incoming connections */
 	for (p = servinfo; p; p = p->ai_next) {
 		sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
 		if (sockfd == -1) {
@@ -74,6 +147,12 @@ int tcp_server_init(char *port)
 			exit(EXIT_FAILURE);
 		}
 
+		if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+					&yes, sizeof(int)) == -1) {
+			syslog(LOG_EMERG, "setsockopt: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
 		if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
 			close(sockfd);
 			syslog(LOG_ERR, "bind: %s\n", strerror(errno));
@@ -84,54 +163,255 @@ int tcp_server_init(char *port)
 	}
 
 	if (!p) {
-		fprintf(stderr, "tcpserver: failed to bind\n");
+		syslog(LOG_EMERG, "failed to bind\n");
 		exit(EXIT_FAILURE);
 	}
 
 	freeaddrinfo(servinfo);
+	return sockfd;
+}
 
-	if (listen(sockfd, BACKLOG) == -1) {
-		syslog(LOG_EMERG, "failed to bind\n");
+static int tcp_listen(char *port, int reuseport)
+{
+	/* create a socket to listen for incoming connections */
+	int sockfd = server_bind(port, SOCK_STREAM, reuseport);
+
+	if (listen(sockfd, admission.backlog) == -1) {
+		syslog(LOG_EMERG, "listen: %s\n", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
 	return sockfd;
 }
 
+int tcp_server_init(char *port)
+{
+	return tcp_listen(port, 0);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Allocates a message for a server loop.  If memory is exhausted, waits and
+ * retries rather than accepting more work; pending connections stay in the
+ * listen backlog and datagrams in the socket buffer meanwhile.
+ */
+static struct msg_info *alloc_msg(void)
+{
+	const struct timespec backoff = { .tv_sec = 0, .tv_nsec = 10000000 };
+	struct msg_info *msg;
+
+	if ((msg = msg_alloc()))
+		return msg;
+
+	syslog(LOG_WARNING, "msg_alloc: out of memory\n");
+	while (!(msg = msg_alloc()))
+		nanosleep(&backoff, NULL);
+	return msg;
+}
+
+/*
+ * Sets the admission control parameters for tcp_server_init() and
+ * tcp_server_main().  Must be called before either of them.
+ */
+void server_set_admission(const struct admission_config *cfg)
+{
+	admission = *cfg;
+	if (admission.backlog <= 0)
+		admission.backlog = BACKLOG;
+}
+
+/*
+ * Gets the number of connections closed unserved by admission control.
+ */
+unsigned long server_shed_count(void)
+{
+	return atomic_load_explicit(&pending.shed, memory_order_relaxed);
+}
+
+/*
+ * Reserves a handler thread.  Returns 0 on success, or -1 if the thread limit
+ * has been reached.
+ */
+static int claim_thread(int max_threads)
+{
+	int n = atomic_load_explicit(&num_threads, memory_order_relaxed);
+
+	do {
+		if (n >= max_threads)
+			return -1;
+	} while (!atomic_compare_exchange_weak_explicit(&num_threads, &n, n + 1,
+				memory_order_relaxed, memory_order_relaxed));
+	return 0;
+}
+
+static void shed(struct msg_info *msg)
+{
+	atomic_fetch_add_explicit(&pending.shed, 1, memory_order_relaxed);
+	metrics_add(METRIC_REJECTED, 1);
+	close(msg->sock);
+	msg_free(msg);
+}
+
+/*
+ * Returns non-zero if a connection arriving now would be expected to wait
+ * longer than the queueing budget.
+ */
+static int over_budget(void)
+{
+	uint64_t budget = admission.queue_budget_ms * 1000000ULL;
+	uint64_t wait;
+
+	if (!admission.shed || !budget)
+		return 0;
+
+	wait = atomic_load_explicit(&pending.latency, memory_order_relaxed)
+		* (atomic_load_explicit(&pending.nr, memory_order_relaxed) + 1)
+		/ pending.max_threads;
+	return wait > budget;
+}
+
+/*
+ * Takes the next pending connection which is still within its queueing
+ * budget, shedding those that are not.  Queued connections are only counted
+ * as accepted here, so that none is counted as both accepted and shed.  If
+ * there is none, the caller's thread slot is released and NULL is returned.
+ */
+static struct msg_info *admit_next(void)
+{
+	uint64_t budget = admission.queue_budget_ms * 1000000ULL;
+	struct msg_info *msg;
+	int n;
+
+	for (;;) {
+		n = atomic_load_explicit(&pending.nr, memory_order_acquire);
+		while (n > 0 && !atomic_compare_exchange_weak_explicit(
+					&pending.nr, &n, n - 1,
+					memory_order_acquire,
+					memory_order_acquire))
+			;
+
+		if (n > 0) {
+			while (!(msg = mpmc_pop(&pending.queue)))
+				sched_yield();
+			if (budget && now_ns() - msg->arrived > budget) {
+				shed(msg);
+				continue;
+			}
+			metrics_add(METRIC_ACCEPTED, 1);
+			return msg;
+		}
+
+		/* a connection may have been queued after we looked */
+		atomic_fetch_sub_explicit(&num_threads, 1, memory_order_release);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (!atomic_load_explicit(&pending.nr, memory_order_acquire)
+				|| claim_thread(pending.max_threads))
+			return NULL;
+	}
+}
+
+/*
+ * Folds a handler's running time into the latency estimate.
+ */
+static void record_latency(uint64_t ns)
+{
+	uint64_t avg = atomic_load_explicit(&pending.latency,
+			memory_order_relaxed);
+
+	avg = avg ? avg - avg / 8 + ns / 8 : ns;
+	atomic_store_explicit(&pending.latency, avg, memory_order_relaxed);
+}
+
+/*
+ * Handler thread for tcp_server_main().  When the callback finishes with a
+ * connection (by service_exit() or by returning), the thread goes on to the
+ * next pending connection, and exits only once there are none.
+ */
+static void *tcp_handler(void *data)
+{
+	static _Thread_local uint64_t started;
+	struct msg_info *volatile msg = data; // live across setjmp()
+	jmp_buf env;
+
+	pthread_detach(pthread_self());
+
+	worker_return = &env;
+	if (setjmp(env)) {
+		record_latency(now_ns() - started);
+		msg = NULL;
+	}
+
+	for (;;) {
+		if (!msg && !(msg = admit_next()))
+			break;
+
+		started = now_ns();
+		pending.cb(msg);
+
+		/* the callback returned without calling service_exit() */
+		record_latency(now_ns() - started);
+		metrics_record_latency(now_ns() - msg->arrived);
+		close(msg->sock);
+		msg_free(msg);
+		msg = NULL;
+	}
+
+	worker_return = NULL;
+	return NULL;
+}
+
+static void spawn_handler(struct msg_info *msg)
+{
+	pthread_t tid;
+
+	if (pthread_create(&tid, NULL, tcp_handler, msg)) {
+		syslog(LOG_ERR, "pthread_create\n");
+		atomic_fetch_sub(&num_threads, 1);
+		if (msg) {
+			close(msg->sock);
+			msg_free(msg);
+		}
+	}
+}
+
 _Noreturn void tcp_server_main(int sock, int max_threads, void*(*cb)(void*))
 {
 	socklen_t sin_size;
 	struct msg_info *targ;
-	pthread_t tid;
 
 	struct timeval tv = { .tv_sec = 30, .tv_usec = 0 };
 
+	pending.max_threads = max_threads;
+	pending.cb = cb;
+	if (admission.queue_len && mpmc_init(&pending.queue,
+				admission.queue_len)) {
+		syslog(LOG_EMERG, "failed to allocate pending queue\n");
+		exit(EXIT_FAILURE);
+	}
+
 	for (;;) {
 
-		targ = malloc(sizeof(struct msg_info));
+		targ = alloc_msg();
 		targ->socktype = SOCK_TCP;
+		targ->shard = NULL;
 
 		/* wait for a connection */
 		sin_size = sizeof(targ->addr);
 		targ->sock = accept(sock, (struct sockaddr*) &targ->addr, &sin_size);
 		if (targ->sock == -1) {
 			syslog(LOG_ERR, "accept: %s\n", strerror(errno));
-			free(targ);
-			continue;
-		}
-
-		/* close connection if thread limit reached */
-		pthread_mutex_lock(&num_threads_lock);
-		if (num_threads >= max_threads) {
-			pthread_mutex_unlock(&num_threads_lock);
-			syslog(LOG_WARNING, "thread limit reached\n");
-			close(targ->sock);
-			free(targ);
+			metrics_add(METRIC_RECV_ERRORS, 1);
+			msg_free(targ);
 			continue;
 		}
-
-		num_threads++;
-		pthread_mutex_unlock(&num_threads_lock);
+		targ->arrived = now_ns();
 
 		setsockopt(targ->sock, SOL_SOCKET, SO_RCVTIMEO, (char*) &tv,
 				sizeof(tv));
@@ -143,128 +423,605 @@ _Noreturn void tcp_server_main(int sock, int max_threads, void*(*cb)(void*))
 		syslog(LOG_INFO, "connection from %s\n", targ->paddr);
 #endif
 		/* create a new thread to service the connection */
-		if (pthread_create(&tid, NULL, cb, targ))
+		if (!claim_thread(max_threads)) {
+			metrics_add(METRIC_ACCEPTED, 1);
+			spawn_handler(targ);
+			continue;
+		}
+
+		/* at the thread limit: queue the connection, or close it */
+		if (!admission.queue_len || over_budget()
+				|| mpmc_push(&pending.queue, targ)) {
+			syslog(LOG_WARNING, "thread limit reached\n");
+			shed(targ);
+			continue;
+		}
+		atomic_fetch_add_explicit(&pending.nr, 1, memory_order_release);
+
+		/*
+		 * A handler may have exited after we looked.  The fence pairs
+		 * with the one in admit_next(): either it sees our connection
+		 * or we see its slot, never neither.
+		 */
+		atomic_thread_fence(memory_order_seq_cst);
+		if (!claim_thread(max_threads))
+			spawn_handler(NULL);
+	}
+}
+
+int udp_server_init(char *port)
+{
+	return server_bind(port, SOCK_DGRAM, 0);
+}
+
+_Noreturn void udp_server_main(int sock, int max_threads, void *(*cb)(void*))
+{
+	struct msg_info *msg;
+	socklen_t sin_size;
+	ssize_t rc;
+	pthread_t tid;
+
+	for(;;) {
+		sin_size = sizeof(msg->addr);
+		msg = alloc_msg();
+		msg->sock = sock;
+		msg->socktype = SOCK_UDP;
+		msg->shard = NULL;
+
+		rc = recvfrom(sock, msg->msg, MSG_MAX-1, 0,
+				(struct sockaddr*) &msg->addr, &sin_size);
+		if (rc == -1) {
+			syslog(LOG_ERR, "recvfrom: %s\n", strerror(errno));
+			metrics_add(METRIC_RECV_ERRORS, 1);
+			msg_free(msg);
+			continue;
+		}
+		msg->msg[rc] = '\0';
+		msg->len = rc;
+		msg->arrived = now_ns();
+		metrics_add(METRIC_BYTES_IN, rc);
+
+		if (claim_thread(max_threads)) {
+			syslog(LOG_WARNING, "thread limit reached\n");
+			metrics_add(METRIC_REJECTED, 1);
+			msg_free(msg);
+			continue;
+		}
+		metrics_add(METRIC_ACCEPTED, 1);
+
+#ifdef VERBOSE_LOG
+		inet_ntop(msg->addr.ss_family,
+				get_in_addr((struct sockaddr*) &msg->addr),
+				msg->paddr, sizeof msg->paddr);
+		syslog(LOG_INFO, "message from %s\n", targ->paddr);
+#endif
+
+		if (pthread_create(&tid, NULL, cb, msg))
 			syslog(LOG_ERR, "pthread_create\n");
 		else
 			pthread_detach(tid);
 	}
+	close(sock);
 }
 
-int udp_server_init(char *port)
+/*
+ * Pool worker: runs the callback for each message popped from the queue.  A
+ * callback which finishes with service_exit() longjmps back to the top of the
+ * loop rather than terminating the thread.
+ */
+static _Noreturn void *pool_worker(void *data)
 {
-	struct addrinfo hints, *servinfo, *p;
-	const int yes = 1;
-	int sockfd;
-	int rc;
+	jmp_buf env;
+	struct msg_info *msg;
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family   = AF_UNSPEC;
-	hints.ai_socktype = SOCK_DGRAM;
-	hints.ai_flags    = AI_PASSIVE;
+	(void) data;
+	pthread_detach(pthread_self());
 
-	if ((rc = getaddrinfo(NULL, port, &hints, &servinfo))) {
-		syslog(LOG_EMERG, "getaddrinfo: %s\n", gai_strerror(rc));
+	worker_return = &env;
+	setjmp(env);
+
+	for (;;) {
+		while (sem_wait(&pool.items) == -1)
+			;
+
+		/* the producer owning the front slot may not have written it */
+		while (!(msg = mpmc_pop(&pool.queue)))
+			sched_yield();
+
+		pool.cb(msg);
+		metrics_record_latency(now_ns() - msg->arrived);
+		msg_free(msg);
+	}
+}
+
+/*
+ * Like udp_server_main(), but messages are handed to a fixed pool of
+ * `nr_workers' threads through a queue of `queue_len' messages rather than
+ * to a new thread each.  Messages are dropped when the queue is full.  The
+ * callback is the same as for udp_server_main(); msg->sock is the server
+ * socket.
+ */
+_Noreturn void udp_server_pool_main(int sock, int nr_workers,
+		size_t queue_len, void *(*cb)(void*))
+{
+	struct msg_info *msg;
+	socklen_t sin_size;
+	ssize_t rc;
+	pthread_t tid;
+
+	if (mpmc_init(&pool.queue, queue_len) || sem_init(&pool.items, 0, 0)) {
+		syslog(LOG_EMERG, "failed to initialize worker pool\n");
 		exit(EXIT_FAILURE);
 	}
+	pool.cb = cb;
 
-	for (p = servinfo; p; p = p->ai_next) {
-		sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (sockfd == -1) {
-			syslog(LOG_ERR, "socket: %s\n", strerror(errno));
-			continue;
+	for (int i = 0; i < nr_workers; i++) {
+		if (pthread_create(&tid, NULL, pool_worker, NULL)) {
+			syslog(LOG_EMERG, "pthread_create\n");
+			exit(EXIT_FAILURE);
 		}
+	}
 
-		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes,
-				sizeof(int)) == -1) {
-			syslog(LOG_EMERG, "setsockopt: %s\n", strerror(errno));
-			exit(EXIT_FAILURE);
+	for (;;) {
+		sin_size = sizeof(msg->addr);
+		msg = alloc_msg();
+		msg->sock = sock;
+		msg->socktype = SOCK_UDP;
+		msg->shard = NULL;
+
+		rc = recvfrom(sock, msg->msg, MSG_MAX-1, 0,
+				(struct sockaddr*) &msg->addr, &sin_size);
+		if (rc == -1) {
+			syslog(LOG_ERR, "recvfrom: %s\n", strerror(errno));
+			metrics_add(METRIC_RECV_ERRORS, 1);
+			msg_free(msg);
+			continue;
 		}
+		msg->msg[rc] = '\0';
+		msg->len = rc;
+		msg->arrived = now_ns();
+		metrics_add(METRIC_BYTES_IN, rc);
 
-		if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-			close(sockfd);
-			syslog(LOG_ERR, "bind: %s\n", strerror(errno));
+#ifdef VERBOSE_LOG
+		inet_ntop(msg->addr.ss_family,
+				get_in_addr((struct sockaddr*) &msg->addr),
+				msg->paddr, sizeof msg->paddr);
+		syslog(LOG_INFO, "message from %s\n", msg->paddr);
+#endif
+
+		if (mpmc_push(&pool.queue, msg)) {
+			syslog(LOG_WARNING, "worker queue full\n");
+			metrics_add(METRIC_REJECTED, 1);
+			msg_free(msg);
 			continue;
 		}
+		metrics_add(METRIC_ACCEPTED, 1);
+		sem_post(&pool.items);
+	}
+}
 
-		break;
+/*
+ * Sends all queued replies with as few calls to sendmmsg() as possible.  A
+ * reply which can't be sent is logged and dropped.
+ */
+void udp_batch_flush(struct udp_batch *batch)
+{
+	unsigned int off = 0;
+	int rc;
+
+	while (off < batch->nr_replies) {
+		rc = sendmmsg(batch->sock, batch->tx + off,
+				batch->nr_replies - off, 0);
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "sendmmsg: %s\n", strerror(errno));
+			rc = 1;
+		} else {
+			for (int i = 0; i < rc; i++)
+				metrics_add(METRIC_BYTES_OUT,
+						batch->tx[off + i].msg_len);
+		}
+		off += rc;
 	}
+	batch->nr_replies = 0;
+}
 
-	if (!p) {
-		syslog(LOG_EMERG, "failed to bind\n");
+/*
+ * Queues a reply to the sender of `msg'.  The data is copied, so `buf' may be
+ * reused immediately.  Replies are sent when the current batch has been
+ * handled, or earlier if the reply queue fills up.  Returns 0 on success, or
+ * -EMSGSIZE if the reply is larger than MSG_MAX.
+ */
+int udp_batch_reply(struct udp_batch *batch, const struct msg_info *msg,
+		const char *buf, size_t len)
+{
+	unsigned int i;
+
+	if (len > MSG_MAX)
+		return -EMSGSIZE;
+
+	if (batch->nr_replies == batch->size)
+		udp_batch_flush(batch);
+
+	i = batch->nr_replies++;
+	memcpy(batch->tx_iov[i].iov_base, buf, len);
+	batch->tx_iov[i].iov_len = len;
+	memcpy(&batch->tx_addr[i], &msg->addr, sizeof(msg->addr));
+	batch->tx[i].msg_hdr.msg_namelen =
+		get_sockaddr_size((struct sockaddr*) &msg->addr);
+	return 0;
+}
+
+static int udp_batch_init(struct udp_batch *batch, int sock,
+		unsigned int size)
+{
+	batch->sock = sock;
+	batch->size = size;
+	batch->nr_replies = 0;
+
+	batch->msgs    = calloc(size, sizeof(struct msg_info));
+	batch->rx      = calloc(size, sizeof(struct mmsghdr));
+	batch->rx_iov  = calloc(size, sizeof(struct iovec));
+	batch->rx_bufs = malloc((size_t) size * MSG_MAX);
+	batch->tx      = calloc(size, sizeof(struct mmsghdr));
+	batch->tx_iov  = calloc(size, sizeof(struct iovec));
+	batch->tx_addr = calloc(size, sizeof(struct sockaddr_storage));
+	batch->tx_bufs = malloc((size_t) size * MSG_MAX);
+
+	if (!batch->msgs || !batch->rx || !batch->rx_iov || !batch->rx_bufs
+			|| !batch->tx || !batch->tx_iov || !batch->tx_addr
+			|| !batch->tx_bufs)
+		return -1;
+
+	for (unsigned int i = 0; i < size; i++) {
+		batch->msgs[i].sock = sock;
+		batch->msgs[i].socktype = SOCK_UDP;
+		batch->msgs[i].msg = batch->rx_bufs + (size_t) i * MSG_MAX;
+
+		batch->rx_iov[i].iov_base = batch->msgs[i].msg;
+		batch->rx_iov[i].iov_len  = MSG_MAX - 1;
+		batch->rx[i].msg_hdr.msg_iov = &batch->rx_iov[i];
+		batch->rx[i].msg_hdr.msg_iovlen = 1;
+		batch->rx[i].msg_hdr.msg_name = &batch->msgs[i].addr;
+
+		batch->tx_iov[i].iov_base = batch->tx_bufs + (size_t) i * MSG_MAX;
+		batch->tx[i].msg_hdr.msg_iov = &batch->tx_iov[i];
+		batch->tx[i].msg_hdr.msg_iovlen = 1;
+		batch->tx[i].msg_hdr.msg_name = &batch->tx_addr[i];
+	}
+	return 0;
+}
+
+/*
+ * Batched UDP server.  Up to `batch_size' datagrams are received per call to
+ * recvmmsg() into preallocated buffers, and `cb' is called for each of them
+ * in the receiving thread.  Replies queued with udp_batch_reply() are flushed
+ * with sendmmsg() on the server socket once the batch has been handled.  The
+ * msg_info passed to `cb' belongs to the server and is only valid for the
+ * duration of the call; service_exit() must not be called on it.
+ */
+_Noreturn void udp_server_batch_main(int sock, unsigned int batch_size,
+		void (*cb)(struct msg_info *msg, struct udp_batch *batch))
+{
+	struct udp_batch batch;
+	struct msg_info *msg;
+	int n;
+
+	if (udp_batch_init(&batch, sock, batch_size)) {
+		syslog(LOG_EMERG, "failed to allocate batch\n");
 		exit(EXIT_FAILURE);
 	}
 
-	freeaddrinfo(servinfo);
+	for (;;) {
+		for (unsigned int i = 0; i < batch_size; i++)
+			batch.rx[i].msg_hdr.msg_namelen =
+				sizeof(struct sockaddr_storage);
 
-	num_threads = 0;
-	pthread_mutex_init(&num_threads_lock, NULL);
+		n = recvmmsg(sock, batch.rx, batch_size, MSG_WAITFORONE, NULL);
+		if (n == -1) {
+			if (errno != EINTR)
+				syslog(LOG_ERR, "recvmmsg: %s\n", strerror(errno));
+			metrics_add(METRIC_RECV_ERRORS, 1);
+			continue;
+		}
 
-	return sockfd;
+		for (int i = 0; i < n; i++) {
+			msg = &batch.msgs[i];
+			msg->len = batch.rx[i].msg_len;
+			msg->msg[msg->len] = '\0';
+			msg->arrived = now_ns();
+			metrics_add(METRIC_BYTES_IN, msg->len);
+			metrics_add(METRIC_ACCEPTED, 1);
+#ifdef VERBOSE_LOG
+			inet_ntop(msg->addr.ss_family,
+					get_in_addr((struct sockaddr*) &msg->addr),
+					msg->paddr, sizeof msg->paddr);
+			syslog(LOG_INFO, "message from %s\n", msg->paddr);
+#endif
+			cb(msg, &batch);
+			metrics_record_latency(now_ns() - msg->arrived);
+		}
+
+		udp_batch_flush(&batch);
+	}
 }
 
-_Noreturn void udp_server_main(int sock, int max_threads, void *(*cb)(void*))
+/*
+ * Pins the calling thread to a shard's CPU, if it has one.
+ */
+static void shard_pin(struct server_shard *shard)
 {
+	cpu_set_t set;
+
+	if (shard->cpu < 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(shard->cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		syslog(LOG_WARNING, "failed to pin shard to CPU %d\n",
+				shard->cpu);
+}
+
+/*
+ * Reserves a handler thread on a shard.  Returns 0 on success, or -1 if the
+ * shard's thread limit has been reached.
+ */
+static int shard_get_thread(struct server_shard *shard)
+{
+	if (atomic_fetch_add_explicit(&shard->nr_threads, 1,
+				memory_order_relaxed) >= shard->max_threads) {
+		atomic_fetch_sub_explicit(&shard->nr_threads, 1,
+				memory_order_relaxed);
+		atomic_fetch_add_explicit(&shard->rejected, 1,
+				memory_order_relaxed);
+		metrics_add(METRIC_REJECTED, 1);
+		return -1;
+	}
+	atomic_fetch_add_explicit(&shard->accepted, 1, memory_order_relaxed);
+	metrics_add(METRIC_ACCEPTED, 1);
+	return 0;
+}
+
+/*
+ * Accept loop for one shard of a sharded TCP server.  This is the same as
+ * tcp_server_main(), except that the thread count belongs to the shard.
+ */
+static void *tcp_shard_main(void *data)
+{
+	struct server_shard *shard = data;
+	socklen_t sin_size;
+	struct msg_info *targ;
+	pthread_t tid;
+
+	struct timeval tv = { .tv_sec = 30, .tv_usec = 0 };
+
+	shard_pin(shard);
+
+	for (;;) {
+		targ = alloc_msg();
+		targ->socktype = SOCK_TCP;
+		targ->shard = shard;
+
+		sin_size = sizeof(targ->addr);
+		targ->sock = accept(shard->sock, (struct sockaddr*) &targ->addr,
+				&sin_size);
+		if (targ->sock == -1) {
+			syslog(LOG_ERR, "accept: %s\n", strerror(errno));
+			metrics_add(METRIC_RECV_ERRORS, 1);
+			msg_free(targ);
+			continue;
+		}
+		targ->arrived = now_ns();
+
+		if (shard_get_thread(shard)) {
+			syslog(LOG_WARNING, "thread limit reached\n");
+			close(targ->sock);
+			msg_free(targ);
+			continue;
+		}
+
+		setsockopt(targ->sock, SOL_SOCKET, SO_RCVTIMEO, (char*) &tv,
+				sizeof(tv));
+
+#ifdef VERBOSE_LOG
+		inet_ntop(targ->addr.ss_family,
+				get_in_addr((struct sockaddr*) &targ->addr),
+				targ->paddr, sizeof targ->paddr);
+		syslog(LOG_INFO, "connection from %s\n", targ->paddr);
+#endif
+		if (pthread_create(&tid, NULL, shard->cb, targ)) {
+			syslog(LOG_ERR, "pthread_create\n");
+			atomic_fetch_sub(&shard->nr_threads, 1);
+			close(targ->sock);
+			msg_free(targ);
+		} else {
+			pthread_detach(tid);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Receive loop for one shard of a sharded UDP server.
+ */
+static void *udp_shard_main(void *data)
+{
+	struct server_shard *shard = data;
 	struct msg_info *msg;
 	socklen_t sin_size;
 	ssize_t rc;
 	pthread_t tid;
 
-	for(;;) {
-		sin_size = sizeof(struct sockaddr_in);
-		msg = malloc(sizeof(struct msg_info));
-		msg->msg = malloc(MSG_MAX);
+	shard_pin(shard);
+
+	for (;;) {
+		sin_size = sizeof(msg->addr);
+		msg = alloc_msg();
+		msg->sock = shard->sock;
 		msg->socktype = SOCK_UDP;
+		msg->shard = shard;
 
-		rc = recvfrom(sock, msg->msg, MSG_MAX-1, 0,
+		rc = recvfrom(shard->sock, msg->msg, MSG_MAX-1, 0,
 				(struct sockaddr*) &msg->addr, &sin_size);
 		if (rc == -1) {
 			syslog(LOG_ERR, "recvfrom: %s\n", strerror(errno));
-			free(msg->msg);
-			free(msg);
+			metrics_add(METRIC_RECV_ERRORS, 1);
+			msg_free(msg);
 			continue;
 		}
 		msg->msg[rc] = '\0';
 		msg->len = rc;
+		msg->arrived = now_ns();
+		metrics_add(METRIC_BYTES_IN, rc);
 
-		pthread_mutex_lock(&num_threads_lock);
-		if (num_threads >= max_threads) {
-			pthread_mutex_unlock(&num_threads_lock);
+		if (shard_get_thread(shard)) {
 			syslog(LOG_WARNING, "thread limit reached\n");
-			free(msg->msg);
-			free(msg);
+			msg_free(msg);
 			continue;
 		}
 
-		num_threads++;
-		pthread_mutex_unlock(&num_threads_lock);
-
 #ifdef VERBOSE_LOG
 		inet_ntop(msg->addr.ss_family,
 				get_in_addr((struct sockaddr*) &msg->addr),
 				msg->paddr, sizeof msg->paddr);
-		syslog(LOG_INFO, "message from %s\n", targ->paddr);
+		syslog(LOG_INFO, "message from %s\n", msg->paddr);
 #endif
 
-		if (pthread_create(&tid, NULL, cb, msg))
+		if (pthread_create(&tid, NULL, shard->cb, msg)) {
 			syslog(LOG_ERR, "pthread_create\n");
-		else
+			atomic_fetch_sub(&shard->nr_threads, 1);
+			msg_free(msg);
+		} else {
 			pthread_detach(tid);
+		}
 	}
-	close(sock);
+	return NULL;
+}
+
+/*
+ * Fills `set' with the CPUs the process may run on, which need not be
+ * numbered contiguously (e.g. under taskset or in a cpuset).  If they can't
+ * be had, the online CPUs are assumed to be 0 to N-1.  Returns their number.
+ */
+static int server_cpus(cpu_set_t *set)
+{
+	long nr_cpus;
+
+	if (!sched_getaffinity(0, sizeof(*set), set) && CPU_COUNT(set) > 0)
+		return CPU_COUNT(set);
+
+	if ((nr_cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		nr_cpus = 1;
+	if (nr_cpus > CPU_SETSIZE)
+		nr_cpus = CPU_SETSIZE;
+	CPU_ZERO(set);
+	for (int i = 0; i < nr_cpus; i++)
+		CPU_SET(i, set);
+	return nr_cpus;
+}
+
+/*
+ * Returns the id of the `n'th CPU in `set'.
+ */
+static int nth_cpu(const cpu_set_t *set, int n)
+{
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, set) && n-- == 0)
+			return cpu;
+	return -1;
+}
+
+/*
+ * Opens `nr_shards' SO_REUSEPORT sockets on `port' (one per CPU the process
+ * may run on if `nr_shards' is 0) and starts an independent accept or receive
+ * loop for each of them.  Each shard has its own thread limit of
+ * `max_threads' and its own counters, so shards share no state.  If `pin' is
+ * set, shard N's loop is pinned to the Nth of those CPUs (modulo their
+ * number).  Returns the array of running shards; `*nr' is set to its length.
+ */
+static struct server_shard *server_shards(char *port, int socktype,
+		int *nr, int pin, int max_threads, void *(*cb)(void*))
+{
+	struct server_shard *shards;
+	cpu_set_t cpus;
+	int nr_cpus = server_cpus(&cpus);
+	int nr_shards = *nr;
+
+	if (nr_shards <= 0)
+		nr_shards = nr_cpus;
+
+	shards = aligned_alloc(_Alignof(struct server_shard),
+			nr_shards * sizeof(struct server_shard));
+	if (!shards) {
+		syslog(LOG_EMERG, "failed to allocate shards\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(shards, 0, nr_shards * sizeof(struct server_shard));
+
+	/* bind every socket before any loop starts receiving */
+	for (int i = 0; i < nr_shards; i++) {
+		if (socktype == SOCK_TCP)
+			shards[i].sock = tcp_listen(port, 1);
+		else
+			shards[i].sock = server_bind(port, SOCK_DGRAM, 1);
+		shards[i].cpu = pin ? nth_cpu(&cpus, i % nr_cpus) : -1;
+		shards[i].max_threads = max_threads;
+		shards[i].cb = cb;
+		atomic_init(&shards[i].nr_threads, 0);
+		atomic_init(&shards[i].accepted, 0);
+		atomic_init(&shards[i].rejected, 0);
+	}
+
+	for (int i = 0; i < nr_shards; i++) {
+		if (pthread_create(&shards[i].tid, NULL,
+					socktype == SOCK_TCP ? tcp_shard_main
+					: udp_shard_main, &shards[i])) {
+			syslog(LOG_EMERG, "pthread_create\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	*nr = nr_shards;
+	return shards;
+}
+
+struct server_shard *tcp_server_shards(char *port, int *nr_shards, int pin,
+		int max_threads, void *(*cb)(void*))
+{
+	return server_shards(port, SOCK_TCP, nr_shards, pin, max_threads, cb);
+}
+
+struct server_shard *udp_server_shards(char *port, int *nr_shards, int pin,
+		int max_threads, void *(*cb)(void*))
+{
+	return server_shards(port, SOCK_UDP, nr_shards, pin, max_threads, cb);
 }
 
 _Noreturn void service_exit(struct msg_info *msg)
 {
-	close(msg->sock);
+	struct server_shard *shard = msg->shard;
+
+	metrics_record_latency(now_ns() - msg->arrived);
+
+	/* UDP messages share the server socket */
+	if (msg->socktype == SOCK_TCP)
+		close(msg->sock);
 #ifdef VERBOSE_LOG
 	syslog(LOG_INFO, "connection from %s closed\n", fdsa->paddr);
 #endif
-	if (msg->socktype == SOCK_UDP)
-		free(msg->msg);
-	free(msg);
+	msg_free(msg);
+
+	if (worker_return)
+		longjmp(*worker_return, 1);
+
+	if (shard) {
+		atomic_fetch_sub_explicit(&shard->nr_threads, 1,
+				memory_order_relaxed);
+		pthread_exit(NULL);
+	}
 
-	pthread_mutex_lock(&num_threads_lock);
-	num_threads--;
-	pthread_mutex_unlock(&num_threads_lock);
+	atomic_fetch_sub_explicit(&num_threads, 1, memory_order_relaxed);
 	pthread_exit(NULL);
 }
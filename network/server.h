@@ -20,6 +20,8 @@
 
 #include <netinet/in.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 
 #define MSG_MAX 512
 
@@ -28,18 +30,52 @@ enum {
 	SOCK_UDP
 };
 
+/*
+ * Admission control for tcp_server_main().  With `queue_len' 0, connections
+ * arriving at the thread limit are closed immediately.
+ */
+struct admission_config {
+	int backlog;                  // listen() backlog
+	size_t queue_len;             // connections queued at the thread limit
+	unsigned int queue_budget_ms; // longest a queued connection may wait
+	int shed;                     // close arrivals expected to miss budget
+};
+
+/*
+ * One listener of a sharded server.  Each shard has its own SO_REUSEPORT
+ * socket, loop thread, thread limit and counters.  Shards are cache line
+ * aligned, so one shard's counters never share a line with another's.
+ */
+struct server_shard {
+	_Alignas(64) int sock;
+	int cpu;                   // CPU the loop is pinned to, or -1
+	int max_threads;
+	atomic_int nr_threads;     // handler threads currently running
+	atomic_ulong accepted;     // connections/datagrams dispatched
+	atomic_ulong rejected;     // dropped at the thread limit
+	void *(*cb)(void*);
+	pthread_t tid;
+};
+
 /*
  * A UDP or TCP message from a client.
  */
 struct msg_info {
 	int sock;
 	int socktype;
+	struct server_shard *shard; // owning shard, or NULL
+	uint64_t arrived;           // when the connection was accepted (ns)
 	char *msg;
 	size_t len;
 	struct sockaddr_storage addr;
 	char paddr[INET6_ADDRSTRLEN];
 };
 
+struct udp_batch;
+
+void server_set_admission(const struct admission_config *cfg);
+unsigned long server_shed_count(void);
+
 int tcp_server_init(char *port);
 
 _Noreturn void tcp_server_main(int sock, int max_threads, void*(*cb)(void*));
@@ -48,6 +84,23 @@ int udp_server_init(char *port);
 
 _Noreturn void udp_server_main(int sock, int max_threads, void *(*cb)(void*));
 
+_Noreturn void udp_server_pool_main(int sock, int nr_workers,
+		size_t queue_len, void *(*cb)(void*));
+
+_Noreturn void udp_server_batch_main(int sock, unsigned int batch_size,
+		void (*cb)(struct msg_info *msg, struct udp_batch *batch));
+
+int udp_batch_reply(struct udp_batch *batch, const struct msg_info *msg,
+		const char *buf, size_t len);
+
+void udp_batch_flush(struct udp_batch *batch);
+
+struct server_shard *tcp_server_shards(char *port, int *nr_shards, int pin,
+		int max_threads, void *(*cb)(void*));
+
+struct server_shard *udp_server_shards(char *port, int *nr_shards, int pin,
+		int max_threads, void *(*cb)(void*));
+
 _Noreturn void service_exit(struct msg_info *msg);
 
 #endif
@@ -0,0 +1,249 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* uring.c
+ *
+ * This file contains a small wrapper around the io_uring system calls: ring
+ * setup and teardown, submission and completion queue access, and provided
+ * buffer rings.  Only what the servers in this directory need is here.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+		unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+			NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+		unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+#define RING_PTR(ring, off) ((void*) ((char*) (ring)->ring + (off)))
+
+/*
+ * Creates an io_uring with (at least) `entries' submission queue entries.
+ * Returns 0 on success, or a negative error number.  Kernels without a
+ * single mmap for both rings are not supported.
+ */
+int uring_init(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd == -1)
+		return -errno;
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		close(ring->fd);
+		return -ENOSYS;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+
+	ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->ring == MAP_FAILED)
+		goto err_close;
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err_unmap;
+
+	ring->sq_entries = p.sq_entries;
+	ring->sq_head  = RING_PTR(ring, p.sq_off.head);
+	ring->sq_tail  = RING_PTR(ring, p.sq_off.tail);
+	ring->sq_mask  = RING_PTR(ring, p.sq_off.ring_mask);
+	ring->sq_array = RING_PTR(ring, p.sq_off.array);
+	ring->sqe_tail = *ring->sq_tail;
+	ring->sq_pending = 0;
+
+	ring->cq_head = RING_PTR(ring, p.cq_off.head);
+	ring->cq_tail = RING_PTR(ring, p.cq_off.tail);
+	ring->cq_mask = RING_PTR(ring, p.cq_off.ring_mask);
+	ring->cqes    = RING_PTR(ring, p.cq_off.cqes);
+	return 0;
+
+err_unmap:
+	munmap(ring->ring, ring->ring_size);
+err_close:
+	close(ring->fd);
+	return -errno;
+}
+
+void uring_destroy(struct uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->ring, ring->ring_size);
+	close(ring->fd);
+}
+
+/*
+ * Returns a zeroed submission queue entry, submitting queued entries first if
+ * the queue is full.  Returns NULL if no entry could be freed.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head, tail;
+
+	tail = ring->sqe_tail;
+	head = atomic_load_explicit((_Atomic unsigned int*) ring->sq_head,
+			memory_order_acquire);
+	if (tail - head >= ring->sq_entries) {
+		if (uring_submit(ring, 0) < 0)
+			return NULL;
+		head = atomic_load_explicit((_Atomic unsigned int*)
+				ring->sq_head, memory_order_acquire);
+		if (tail - head >= ring->sq_entries)
+			return NULL;
+	}
+
+	sqe = &ring->sqes[tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+	ring->sqe_tail = tail + 1;
+	ring->sq_pending++;
+	return sqe;
+}
+
+/*
+ * Submits all queued entries and waits for at least `wait_nr' completions.
+ * Returns the number of entries submitted, or a negative error number.
+ */
+int uring_submit(struct uring *ring, unsigned int wait_nr)
+{
+	int rc;
+
+	/* publish the entries filled in since the last submission */
+	atomic_store_explicit((_Atomic unsigned int*) ring->sq_tail,
+			ring->sqe_tail, memory_order_release);
+
+	rc = sys_io_uring_enter(ring->fd, ring->sq_pending, wait_nr,
+			wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	if (rc == -1)
+		return -errno;
+	ring->sq_pending -= rc;
+	return rc;
+}
+
+/*
+ * Returns the next completion, or NULL if the completion queue is empty.
+ * The entry must be released with uring_cqe_seen().
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == atomic_load_explicit((_Atomic unsigned int*) ring->cq_tail,
+				memory_order_acquire))
+		return NULL;
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+	atomic_store_explicit((_Atomic unsigned int*) ring->cq_head,
+			*ring->cq_head + 1, memory_order_release);
+}
+
+/*
+ * Registers a ring of `nr' provided buffers of `size' bytes each as buffer
+ * group `bgid'.  `nr' must be a power of two.  Returns 0 on success, or a
+ * negative error number (-EINVAL on kernels without provided buffer rings).
+ */
+int uring_bufs_init(struct uring *ring, struct uring_bufs *bufs,
+		unsigned short bgid, unsigned int nr, unsigned int size)
+{
+	struct io_uring_buf_reg reg;
+	size_t ring_size = nr * sizeof(struct io_uring_buf);
+
+	bufs->mem_size = ring_size + (size_t) nr * size;
+	bufs->br = mmap(NULL, bufs->mem_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bufs->br == MAP_FAILED)
+		return -errno;
+
+	bufs->base = (char*) bufs->br + ring_size;
+	bufs->nr = nr;
+	bufs->size = size;
+	bufs->bgid = bgid;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) bufs->br;
+	reg.ring_entries = nr;
+	reg.bgid = bgid;
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg,
+				1) == -1) {
+		int rc = -errno;
+		munmap(bufs->br, bufs->mem_size);
+		return rc;
+	}
+
+	bufs->br->tail = 0;
+	for (unsigned int i = 0; i < nr; i++)
+		uring_bufs_put(bufs, i);
+	return 0;
+}
+
+void uring_bufs_destroy(struct uring *ring, struct uring_bufs *bufs)
+{
+	struct io_uring_buf_reg reg;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = bufs->bgid;
+	sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	munmap(bufs->br, bufs->mem_size);
+}
+
+/*
+ * Returns buffer `bid' to the kernel.
+ */
+void uring_bufs_put(struct uring_bufs *bufs, unsigned short bid)
+{
+	unsigned short tail = bufs->br->tail;
+	struct io_uring_buf *buf = &bufs->br->bufs[tail & (bufs->nr - 1)];
+
+	buf->addr = (unsigned long) uring_buf(bufs, bid);
+	buf->len = bufs->size;
+	buf->bid = bid;
+	atomic_store_explicit((_Atomic unsigned short*) &bufs->br->tail,
+			tail + 1, memory_order_release);
+}
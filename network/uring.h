@@ -0,0 +1,78 @@
+/* Copyright 2013 Drew Thoreson */
+
+/*
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring instance, driven directly through the system calls.
+ */
+struct uring {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sqe_tail;          // tail of the SQEs filled in so far
+	unsigned int sq_pending;        // SQEs queued but not yet submitted
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *ring;
+	size_t ring_size;
+	size_t sqes_size;
+};
+
+/*
+ * A ring of provided buffers, from which the kernel picks a buffer for each
+ * completion of a buffer-select request (e.g. multishot recv).
+ */
+struct uring_bufs {
+	struct io_uring_buf_ring *br;
+	char *base;
+	unsigned int nr;               // number of buffers (power of two)
+	unsigned int size;             // size of each buffer
+	unsigned short bgid;
+	size_t mem_size;
+};
+
+int uring_init(struct uring *ring, unsigned int entries);
+void uring_destroy(struct uring *ring);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit(struct uring *ring, unsigned int wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+int uring_bufs_init(struct uring *ring, struct uring_bufs *bufs,
+		unsigned short bgid, unsigned int nr, unsigned int size);
+void uring_bufs_destroy(struct uring *ring, struct uring_bufs *bufs);
+void uring_bufs_put(struct uring_bufs *bufs, unsigned short bid);
+
+static inline char *uring_buf(struct uring_bufs *bufs, unsigned short bid)
+{
+	return bufs->base + (size_t) bid * bufs->size;
+}
+
+#endif